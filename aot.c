@@ -0,0 +1,625 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "aot.h"
+#include "blockcache.h"
+
+#define AOT_OPERAND_REGISTER			0
+#define AOT_OPERAND_MEMORY			1	// Address in a variable
+#define AOT_OPERAND_CONSTANT			2
+
+typedef struct _aot_operand_t
+{
+	unsigned char kind;
+	char text[32];		// Register variable, address variable or constant
+} aot_operand_t;
+
+typedef struct _aot_instruction_t
+{
+	DCPU16_WORD address;
+	DCPU16_WORD next;	// Address of the following instruction
+	unsigned length;
+
+	unsigned char opcode;
+	unsigned char first;	// bits 4-9
+	unsigned char second;	// bits 10-15
+
+	// Writes a literal (basic) or is the reserved non-basic opcode
+	unsigned char fault;
+
+	// Control flow
+	unsigned char writes_pc;
+	unsigned char target_known;
+	unsigned char conditional;
+	unsigned char falls_through;
+	DCPU16_WORD target;
+
+} aot_instruction_t;
+
+static const char *aot_register_names[] = { "a", "b", "c", "x", "y", "z", "i", "j" };
+
+/* FNV-1a hash of the RAM, identifies the image translated code belongs to. */
+uint64_t aot_hash_image(const dcpu16_t *computer)
+{
+	uint64_t hash = 14695981039346656037ull;
+	const unsigned char *p = (const unsigned char *)computer->ram;
+
+	for(unsigned i = 0; i < sizeof(computer->ram); i++)
+		hash = (hash ^ p[i]) * 1099511628211ull;
+
+	return hash;
+}
+
+/* Returns true if the AB value is followed by an extra word. */
+static int aot_has_next_word(unsigned char v)
+{
+	return (v >= DCPU16_AB_VALUE_PTR_REG_A_PLUS_WORD && v <= DCPU16_AB_VALUE_PTR_REG_J_PLUS_WORD) ||
+		v == DCPU16_AB_VALUE_PTR_WORD || v == DCPU16_AB_VALUE_WORD;
+}
+
+/* Same as dcpu16_is_literal. */
+static int aot_is_literal(unsigned char v)
+{
+	return v == DCPU16_AB_VALUE_WORD || (v >= 0x20 && v <= 0x3F);
+}
+
+static unsigned aot_length(DCPU16_WORD w)
+{
+	unsigned char opcode = w & 0xF;
+	unsigned char first = (w >> 4) & 0x3F;
+	unsigned char second = (w >> 10) & 0x3F;
+
+	if(opcode == DCPU16_OPCODE_NON_BASIC)
+		return 1 + aot_has_next_word(second);
+
+	return 1 + aot_has_next_word(first) + aot_has_next_word(second);
+}
+
+/* Returns the value of a literal AB value, the extra word is the one at address. */
+static DCPU16_WORD aot_literal(const DCPU16_WORD *ram, unsigned char v, DCPU16_WORD address)
+{
+	return v == DCPU16_AB_VALUE_WORD ? ram[address] : v - 0x20;
+}
+
+/* Decodes the instruction at address and works out where it can go next. */
+static void aot_decode(const DCPU16_WORD *ram, DCPU16_WORD address, aot_instruction_t *ins)
+{
+	DCPU16_WORD w = ram[address];
+
+	memset(ins, 0, sizeof(*ins));
+	ins->address = address;
+	ins->length = aot_length(w);
+	ins->next = address + ins->length;
+	ins->opcode = w & 0xF;
+	ins->first = (w >> 4) & 0x3F;
+	ins->second = (w >> 10) & 0x3F;
+	ins->falls_through = 1;
+
+	if(ins->opcode == DCPU16_OPCODE_NON_BASIC) {
+		if(ins->first == DCPU16_NON_BASIC_OPCODE_RESERVED_0) {
+			// dcpu16_step counts a fault and carries on with the next instruction (e.g. after an inline DAT 0).
+			// Runs of zero words are most likely free RAM after the program, they are left to the interpreter.
+			ins->fault = 1;
+			ins->falls_through = ram[ins->next] != 0;
+		} else if(ins->first == DCPU16_NON_BASIC_OPCODE_JSR_A) {
+			// The return address is reached through SET PC, POP, so keep following it
+			ins->writes_pc = 1;
+
+			if(aot_is_literal(ins->second)) {
+				ins->target_known = 1;
+				ins->target = aot_literal(ram, ins->second, address + 1);
+			}
+		}
+
+		return;
+	}
+
+	DCPU16_WORD b_address = address + 1 + aot_has_next_word(ins->first);
+
+	if(aot_is_literal(ins->first) && ins->opcode >= DCPU16_OPCODE_SET && ins->opcode <= DCPU16_OPCODE_XOR) {
+		ins->fault = 1;
+	} else if(ins->opcode >= DCPU16_OPCODE_IFE) {
+		ins->conditional = 1;
+		ins->target = ins->next + aot_length(ram[ins->next]);
+	} else if(ins->first == DCPU16_AB_VALUE_REG_PC) {
+		ins->writes_pc = 1;
+
+		// Jumps and relative jumps by a literal
+		if(aot_is_literal(ins->second)) {
+			DCPU16_WORD value = aot_literal(ram, ins->second, b_address);
+
+			if(ins->opcode == DCPU16_OPCODE_SET) {
+				ins->target_known = 1;
+				ins->target = value;
+			} else if(ins->opcode == DCPU16_OPCODE_ADD) {
+				ins->target_known = 1;
+				ins->target = ins->next + value;
+			} else if(ins->opcode == DCPU16_OPCODE_SUB) {
+				ins->target_known = 1;
+				ins->target = ins->next - value;
+			}
+		}
+
+		// SET PC always leaves, the others might not (DIV and MOD by 0 don't change PC)
+		ins->falls_through = ins->opcode != DCPU16_OPCODE_SET;
+	}
+}
+
+/* Emits the operand lookup (dcpu16_get_pointer) for the AB value whose extra word is at *address. */
+static void aot_emit_operand(FILE *f, const DCPU16_WORD *ram, unsigned char v, const char *name, DCPU16_WORD *address, aot_operand_t *operand)
+{
+	operand->kind = AOT_OPERAND_MEMORY;
+	snprintf(operand->text, sizeof(operand->text), "%s_address", name);
+
+	if(v <= DCPU16_AB_VALUE_REG_J) {
+		operand->kind = AOT_OPERAND_REGISTER;
+		snprintf(operand->text, sizeof(operand->text), "%s", aot_register_names[v]);
+	} else if(v <= DCPU16_AB_VALUE_PTR_REG_J) {
+		fprintf(f, "\t\tDCPU16_WORD %s_address = %s;\n", name, aot_register_names[v - DCPU16_AB_VALUE_PTR_REG_A]);
+	} else if(v <= DCPU16_AB_VALUE_PTR_REG_J_PLUS_WORD) {
+		fprintf(f, "\t\tDCPU16_WORD %s_address = %s + 0x%.4x;\n", name, aot_register_names[v - DCPU16_AB_VALUE_PTR_REG_A_PLUS_WORD], ram[(*address)++]);
+	} else if(v >= 0x20) {
+		operand->kind = AOT_OPERAND_CONSTANT;
+		snprintf(operand->text, sizeof(operand->text), "(DCPU16_WORD)0x%.4x", v - 0x20);
+	} else {
+		switch(v) {
+		case DCPU16_AB_VALUE_POP:
+			fprintf(f, "\t\tDCPU16_WORD %s_address = sp++;\n", name);
+			break;
+		case DCPU16_AB_VALUE_PEEK:
+			fprintf(f, "\t\tDCPU16_WORD %s_address = sp;\n", name);
+			break;
+		case DCPU16_AB_VALUE_PUSH:
+			fprintf(f, "\t\tDCPU16_WORD %s_address = --sp;\n", name);
+			break;
+		case DCPU16_AB_VALUE_REG_SP:
+		case DCPU16_AB_VALUE_REG_PC:
+		case DCPU16_AB_VALUE_REG_O:
+			operand->kind = AOT_OPERAND_REGISTER;
+			snprintf(operand->text, sizeof(operand->text), "%s",
+				v == DCPU16_AB_VALUE_REG_SP ? "sp" : v == DCPU16_AB_VALUE_REG_PC ? "pc" : "o");
+			break;
+		case DCPU16_AB_VALUE_PTR_WORD:
+			fprintf(f, "\t\tDCPU16_WORD %s_address = 0x%.4x;\n", name, ram[(*address)++]);
+			break;
+		case DCPU16_AB_VALUE_WORD:
+			// The extra word is read straight from RAM, devices can't be mapped over translated code
+			operand->kind = AOT_OPERAND_CONSTANT;
+			snprintf(operand->text, sizeof(operand->text), "(DCPU16_WORD)0x%.4x", ram[(*address)++]);
+			break;
+		};
+	}
+}
+
+/* Emits reading the operand (dcpu16_get) where needed and stores the C expression for its value in expression. */
+static void aot_emit_get(FILE *f, const aot_operand_t *operand, unsigned *temporaries, char *expression)
+{
+	if(operand->kind != AOT_OPERAND_MEMORY) {
+		strcpy(expression, operand->text);
+		return;
+	}
+
+	sprintf(expression, "t%u", (*temporaries)++);
+	fprintf(f, "\t\tDCPU16_WORD %s; AOT_GET(%s, %s);\n", expression, expression, operand->text);
+}
+
+/* Emits writing the operand (dcpu16_set). */
+static void aot_emit_set(FILE *f, const aot_operand_t *operand, const char *value)
+{
+	if(operand->kind == AOT_OPERAND_REGISTER)
+		fprintf(f, "\t\t%s = %s;\n", operand->text, value);
+	else if(operand->kind == AOT_OPERAND_MEMORY)
+		fprintf(f, "\t\tAOT_SET(%s, %s);\n", operand->text, value);
+}
+
+/* Shifting by 32 or more is undefined in C. The interpreter shifts by values only known at run time, which
+   on x86 uses the lowest 5 bits of the count, while the compiler would fold a constant count differently,
+   so constant counts are masked here. */
+static void aot_mask_shift(const aot_operand_t *count, aot_operand_t *masked)
+{
+	*masked = *count;
+
+	if(count->kind == AOT_OPERAND_CONSTANT) {
+		unsigned long value = strtoul(count->text + strlen("(DCPU16_WORD)"), 0, 16);
+
+		if(value >= 32)
+			snprintf(masked->text, sizeof(masked->text), "(DCPU16_WORD)0x%.4lx", value & 31);
+	}
+}
+
+/* Emits a basic instruction (the switch in dcpu16_step), returns its cycles without the operand lookups. */
+static unsigned aot_emit_basic(FILE *f, const aot_instruction_t *ins, const aot_operand_t *a, const aot_operand_t *b,
+	unsigned *temporaries, char *condition)
+{
+	char a_value[32] = "", b_value[32], value[128];
+	aot_operand_t shift;
+
+	if(ins->opcode == DCPU16_OPCODE_SHL || ins->opcode == DCPU16_OPCODE_SHR) {
+		aot_mask_shift(b, &shift);
+		b = &shift;
+	}
+
+	// Same as dcpu16_step, each operand is read once and SET doesn't read A
+	aot_emit_get(f, b, temporaries, b_value);
+	if(ins->opcode != DCPU16_OPCODE_SET)
+		aot_emit_get(f, a, temporaries, a_value);
+
+	switch(ins->opcode) {
+	case DCPU16_OPCODE_SET:
+		aot_emit_set(f, a, b_value);
+		return 1;
+	case DCPU16_OPCODE_ADD:
+		fprintf(f, "\t\to = (int)%s + (int)%s > 0xFFFF ? 1 : 0;\n", a_value, b_value);
+		sprintf(value, "%s + %s", a_value, b_value);
+		aot_emit_set(f, a, value);
+		return 2;
+	case DCPU16_OPCODE_SUB:
+		fprintf(f, "\t\to = (int)%s - (int)%s < 0 ? 0xFFFF : 0;\n", a_value, b_value);
+		sprintf(value, "%s - %s", a_value, b_value);
+		aot_emit_set(f, a, value);
+		return 2;
+	case DCPU16_OPCODE_MUL:
+		fprintf(f, "\t\to = ((%s * %s) >> 16) & 0xFFFF;\n", a_value, b_value);
+		sprintf(value, "%s * %s", a_value, b_value);
+		aot_emit_set(f, a, value);
+		return 2;
+	case DCPU16_OPCODE_DIV:
+		fprintf(f, "\t\tif(%s == 0) {\n\t\t\ta = 0;\n\t\t\to = 0;\n\t\t} else {\n", b_value);
+		fprintf(f, "\t\to = ((%s << 16) / %s) & 0xFFFF;\n", a_value, b_value);
+		sprintf(value, "%s / %s", a_value, b_value);
+		aot_emit_set(f, a, value);
+		fprintf(f, "\t\t}\n");
+		return 3;
+	case DCPU16_OPCODE_MOD:
+		fprintf(f, "\t\tif(%s == 0) {\n\t\t\ta = 0;\n\t\t} else {\n", b_value);
+		sprintf(value, "%s %% %s", a_value, b_value);
+		aot_emit_set(f, a, value);
+		fprintf(f, "\t\t}\n");
+		return 3;
+	case DCPU16_OPCODE_SHL:
+		fprintf(f, "\t\to = ((%s << %s) >> 16) & 0xFFFF;\n", a_value, b_value);
+		sprintf(value, "%s << %s", a_value, b_value);
+		aot_emit_set(f, a, value);
+		return 2;
+	case DCPU16_OPCODE_SHR:
+		fprintf(f, "\t\to = ((%s << 16) >> %s) & 0xFFFF;\n", a_value, b_value);
+		sprintf(value, "%s >> %s", a_value, b_value);
+		aot_emit_set(f, a, value);
+		return 2;
+	case DCPU16_OPCODE_AND:
+		sprintf(value, "%s & %s", a_value, b_value);
+		aot_emit_set(f, a, value);
+		return 1;
+	case DCPU16_OPCODE_BOR:
+		sprintf(value, "%s | %s", a_value, b_value);
+		aot_emit_set(f, a, value);
+		return 1;
+	case DCPU16_OPCODE_XOR:
+		sprintf(value, "%s ^ %s", a_value, b_value);
+		aot_emit_set(f, a, value);
+		return 1;
+
+	// The conditions under which the next instruction is skipped (IFB is parsed as a & (b == 0) by dcpu16_step)
+	case DCPU16_OPCODE_IFE:
+		sprintf(condition, "%s != %s", a_value, b_value);
+		return 2;
+	case DCPU16_OPCODE_IFN:
+		sprintf(condition, "%s == %s", a_value, b_value);
+		return 2;
+	case DCPU16_OPCODE_IFG:
+		sprintf(condition, "%s <= %s", a_value, b_value);
+		return 2;
+	case DCPU16_OPCODE_IFB:
+		sprintf(condition, "(%s & (%s == 0))", a_value, b_value);
+		return 2;
+	};
+
+	return 0;
+}
+
+/* Emits the stack pointer changes of dcpu16_skip_next_instruction. */
+static void aot_emit_skip(FILE *f, const DCPU16_WORD *ram, DCPU16_WORD address)
+{
+	DCPU16_WORD w = ram[address];
+	unsigned char values[2] = { (w >> 4) & 0x3F, (w >> 10) & 0x3F };
+
+	for(int v = (w & 0xF) == DCPU16_OPCODE_NON_BASIC; v < 2; v++) {
+		if(values[v] == DCPU16_AB_VALUE_POP)
+			fprintf(f, "\t\t\tsp++;\n");
+		else if(values[v] == DCPU16_AB_VALUE_PUSH)
+			fprintf(f, "\t\t\tsp--;\n");
+	}
+}
+
+/* Emits the comparison of the words at address with the ones translated. */
+static void aot_emit_words(FILE *f, const DCPU16_WORD *ram, DCPU16_WORD address, unsigned length, int first)
+{
+	for(unsigned n = 0; n < length; n++, address++)
+		fprintf(f, "%sram[0x%.4x] == 0x%.4x", first && n == 0 ? "" : " && ", address, ram[address]);
+}
+
+/* Emits a jump to the translated instruction at address, or through the switch on PC if there is none. */
+static void aot_emit_goto(FILE *f, const unsigned char *starts, DCPU16_WORD address, const char *indent)
+{
+	if(starts[address])
+		fprintf(f, "%sgoto L_%.4x;\n", indent, address);
+	else
+		fprintf(f, "%sgoto dispatch;\n", indent);
+}
+
+/* Emits the C code of one instruction. */
+static void aot_emit_instruction(FILE *f, const DCPU16_WORD *ram, const unsigned char *starts, const aot_instruction_t *ins)
+{
+	fprintf(f, "L_%.4x: {\n", ins->address);
+
+	// The words of the instruction, and of the one it might skip, must be the ones translated
+	fprintf(f, "\t\tAOT_CHECK(0x%.4x, ", ins->address);
+	aot_emit_words(f, ram, ins->address, ins->length, 1);
+	if(ins->conditional)
+		aot_emit_words(f, ram, ins->next, aot_length(ram[ins->next]), 0);
+	fprintf(f, ");\n");
+
+	fprintf(f, "\t\tpc = 0x%.4x;\n", ins->next);
+
+	// Operand lookups, each extra word costs a cycle
+	DCPU16_WORD next_word = ins->address + 1;
+	unsigned operand_cycles = 0;
+	unsigned temporaries = 0;
+	aot_operand_t a, b;
+	char condition[128] = "";
+
+	if(ins->opcode == DCPU16_OPCODE_NON_BASIC) {
+		operand_cycles += aot_has_next_word(ins->second);
+		aot_emit_operand(f, ram, ins->second, "a", &next_word, &a);
+
+		if(ins->first == DCPU16_NON_BASIC_OPCODE_RESERVED_0) {
+			fprintf(f, "\t\tcomputer->stats.faults++;\n");
+		} else if(ins->first == DCPU16_NON_BASIC_OPCODE_JSR_A) {
+			char value[32];
+
+			fprintf(f, "\t\tAOT_PUSH_PC();\n");
+			aot_emit_get(f, &a, &temporaries, value);
+			fprintf(f, "\t\tpc = %s;\n", value);
+		}
+	} else {
+		operand_cycles += aot_has_next_word(ins->first) + aot_has_next_word(ins->second);
+		aot_emit_operand(f, ram, ins->first, "a", &next_word, &a);
+		aot_emit_operand(f, ram, ins->second, "b", &next_word, &b);
+
+		if(ins->fault) {
+			// dcpu16_step gives up after the operand lookups and reports no cycles
+			fprintf(f, "\t\tcomputer->stats.faults++;\n");
+			operand_cycles = 0;
+		} else {
+			operand_cycles += aot_emit_basic(f, ins, &a, &b, &temporaries, condition);
+		}
+	}
+
+	// Where to go next
+	if(ins->conditional) {
+		fprintf(f, "\t\tif(%s) {\n", condition);
+		aot_emit_skip(f, ram, ins->next);
+		fprintf(f, "\t\t\tpc = 0x%.4x;\n\t\t\tAOT_END(%u);\n", ins->target, operand_cycles + 1);
+		aot_emit_goto(f, starts, ins->target, "\t\t\t");
+		fprintf(f, "\t\t}\n\t\tAOT_END(%u);\n", operand_cycles);
+		aot_emit_goto(f, starts, ins->next, "\t\t");
+	} else if(ins->writes_pc && ins->target_known && ins->target == ins->address) {
+		fprintf(f, "\t\tAOT_HALT(%u);\n", operand_cycles);
+	} else if(ins->writes_pc && ins->target_known) {
+		fprintf(f, "\t\tAOT_END(%u);\n", operand_cycles);
+		aot_emit_goto(f, starts, ins->target, "\t\t");
+	} else if(ins->writes_pc) {
+		fprintf(f, "\t\tif(pc == 0x%.4x)\n\t\t\tAOT_HALT(%u);\n", ins->address, operand_cycles);
+		fprintf(f, "\t\tAOT_END(%u);\n\t\tgoto dispatch;\n", operand_cycles);
+	} else {
+		fprintf(f, "\t\tAOT_END(%u);\n", operand_cycles);
+		aot_emit_goto(f, starts, ins->next, "\t\t");
+	}
+
+	fprintf(f, "\t}\n");
+}
+
+/* Translates the code reachable from entry (and from the block starts in profile, if set) into a C file.
+   Returns the number of instructions translated, 0 on failure. */
+unsigned aot_translate(const dcpu16_t *computer, DCPU16_WORD entry, const blockcache_t *profile, const char *file)
+{
+	const DCPU16_WORD *ram = computer->ram;
+	unsigned char *starts = calloc(DCPU16_RAM_SIZE, 1);
+	unsigned char *code = calloc(DCPU16_RAM_SIZE / 8, 1);
+	DCPU16_WORD *work = malloc(DCPU16_RAM_SIZE * sizeof(DCPU16_WORD));
+	unsigned work_count = 0;
+	unsigned instruction_count = 0;
+
+	if(!starts || !code || !work) {
+		free(starts);
+		free(code);
+		free(work);
+		return 0;
+	}
+
+	// Follow every path with a target known at translation time
+	starts[entry] = 1;
+	work[work_count++] = entry;
+
+	for(unsigned address = 0; profile && address < DCPU16_RAM_SIZE; address++) {
+		if(profile->block_hits[address] && !starts[address]) {
+			starts[address] = 1;
+			work[work_count++] = address;
+		}
+	}
+
+	while(work_count) {
+		aot_instruction_t ins;
+		aot_decode(ram, work[--work_count], &ins);
+		instruction_count++;
+
+		DCPU16_WORD successors[3];
+		unsigned successor_count = 0;
+
+		if(ins.falls_through)
+			successors[successor_count++] = ins.next;
+		if(ins.conditional || ins.target_known)
+			successors[successor_count++] = ins.target;
+
+		for(unsigned n = 0; n < successor_count; n++) {
+			if(!starts[successors[n]]) {
+				starts[successors[n]] = 1;
+				work[work_count++] = successors[n];
+			}
+		}
+
+		for(unsigned n = 0; n < ins.length; n++) {
+			DCPU16_WORD address = ins.address + n;
+			code[address >> 3] |= 1 << (address & 7);
+		}
+	}
+
+	FILE *f = fopen(file, "w");
+	if(!f) {
+		free(starts);
+		free(code);
+		free(work);
+		return 0;
+	}
+
+	fprintf(f, "/* Translated by dcpu16 -aot from a program image (entry %.4x, %u instructions).\n"
+		"   Build the emulator with it using: make aot AOT=%s */\n\n", entry, instruction_count, file);
+	fprintf(f, "#include \"aot.h\"\n\n");
+
+	fprintf(f, "static const unsigned char aot_code[DCPU16_RAM_SIZE / 8] = {");
+	for(unsigned n = 0, column = 0; n < DCPU16_RAM_SIZE / 8; n++) {
+		if(code[n])
+			fprintf(f, "%s[0x%.4x] = 0x%.2x,", column++ % 8 ? " " : "\n\t", n, code[n]);
+	}
+	fprintf(f, "\n};\n\n");
+
+	fprintf(f, "static const DCPU16_WORD aot_words[] = {");
+	for(unsigned address = 0, column = 0; address < DCPU16_RAM_SIZE; address++) {
+		if(AOT_BIT(code, address))
+			fprintf(f, "%s0x%.4x,", column++ % 8 ? " " : "\n\t", ram[address]);
+	}
+	fprintf(f, "\n};\n\n");
+
+	fprintf(f, "static unsigned aot_translated_run(aot_t *aot, dcpu16_t *computer, unsigned count)\n{\n");
+	fprintf(f, "\tAOT_DECLARE_STATE();\n\tAOT_LOAD_STATE();\n\n\tgoto dispatch;\n\n");
+
+	for(unsigned address = 0; address < DCPU16_RAM_SIZE; address++) {
+		if(starts[address]) {
+			aot_instruction_t ins;
+			aot_decode(ram, address, &ins);
+			aot_emit_instruction(f, ram, starts, &ins);
+		}
+	}
+
+	// Jumps to targets only known at run time
+	fprintf(f, "\ndispatch:\n\tswitch(pc) {\n");
+	for(unsigned address = 0; address < DCPU16_RAM_SIZE; address++) {
+		if(starts[address])
+			fprintf(f, "\tcase 0x%.4x: goto L_%.4x;\n", address, address);
+	}
+	fprintf(f, "\t};\n\n");
+
+	fprintf(f, "out:\n\tAOT_SAVE_STATE();\n\n\treturn n;\n}\n\n");
+
+	fprintf(f, "const aot_image_t aot_image = { 0x%.16llxull, 0x%.4x, %u, aot_code, aot_words, aot_translated_run };\n",
+		(unsigned long long)aot_hash_image(computer), entry, instruction_count);
+
+	int ok = !ferror(f);
+	ok = fclose(f) == 0 && ok;
+
+	free(starts);
+	free(code);
+	free(work);
+
+	return ok ? instruction_count : 0;
+}
+
+/* Attaches the translated code to the computer if it was translated from the image in RAM. Returns true if it was attached. */
+int aot_init(aot_t *aot, dcpu16_t *computer, const aot_image_t *image)
+{
+	memset(aot, 0, sizeof(*aot));
+	aot->image = image;
+
+	if(aot_hash_image(computer) != image->hash)
+		return 0;
+
+	computer->aot = aot;
+
+	return 1;
+}
+
+/* Call this when RAM was changed by something else than the CPU (e.g. a new program was loaded). */
+void aot_invalidate(aot_t *aot)
+{
+	aot->dirty = 1;
+}
+
+/* Clears dirty if RAM holds the translated words again. */
+static void aot_revalidate(aot_t *aot, const dcpu16_t *computer)
+{
+	const aot_image_t *image = aot->image;
+	unsigned n = 0;
+
+	for(unsigned address = 0; address < DCPU16_RAM_SIZE; address += 8) {
+		if(!image->code[address >> 3])
+			continue;
+
+		for(unsigned bit = 0; bit < 8; bit++) {
+			if(AOT_BIT(image->code, address + bit) && computer->ram[address + bit] != image->words[n++])
+				return;
+		}
+	}
+
+	aot->dirty = 0;
+}
+
+/* Called before every batch, returns true if the translated code can run it. */
+int aot_prepare(aot_t *aot, dcpu16_t *computer)
+{
+	// All of these want to see every instruction
+	if(computer->profiling.enabled || computer->coverage.bitmap || computer->heatmap || computer->blockcache ||
+	   computer->callback.register_changed || computer->callback.unmapped_ram_changed || computer->callback.illegal_instruction)
+		return 0;
+
+	memset(aot->mapped, 0, sizeof(aot->mapped));
+
+	for(int slot = 0; slot < DCPU16_DEVICE_SLOTS; slot++) {
+		dcpu16_device_t *dev = computer->devices[slot];
+		if(!dev)
+			continue;
+
+		for(unsigned address = dev->ram_start_address; address <= dev->ram_end_address; address++) {
+			if(AOT_BIT(aot->image->code, address))
+				return 0;
+
+			aot->mapped[address >> 3] |= 1 << (address & 7);
+		}
+	}
+
+	if(aot->dirty && ++aot->dirty_batches >= AOT_REVALIDATE_BATCHES) {
+		aot->dirty_batches = 0;
+		aot_revalidate(aot, computer);
+	}
+
+	return 1;
+}
+
+/* Same as dcpu16_get for a device mapped address. */
+DCPU16_WORD aot_device_read(dcpu16_t *computer, DCPU16_WORD address)
+{
+	dcpu16_device_t *dev = dcpu16_mapped_device(computer, address);
+
+	computer->stats.device_reads++;
+
+	return dev->read(dev, address - dev->ram_start_address);
+}
+
+/* Same as dcpu16_set for a device mapped address. */
+void aot_device_write(dcpu16_t *computer, DCPU16_WORD address, DCPU16_WORD value)
+{
+	dcpu16_device_t *dev = dcpu16_mapped_device(computer, address);
+
+	computer->stats.device_writes++;
+
+	dev->write(dev, address - dev->ram_start_address, value);
+}
@@ -0,0 +1,185 @@
+#ifndef AOT_H
+#define AOT_H
+
+#include <stdint.h>
+#include "dcpu16.h"
+
+/* Ahead-of-time translation of a program image into C.
+
+   aot_translate follows the control flow of the image in RAM from an entry point and writes a C file
+   with one label per instruction it can reach statically. Jumps with a target known at translation time
+   become gotos, other jumps (SET PC, POP ...) go through a switch on PC. The file is compiled into the
+   emulator with 'make aot AOT=file.c' and used by dcpu16_run when the loaded image is the one it was
+   translated from.
+
+   Code only reached through jumps to targets computed at run time (SET PC, [table + I] ...) is translated
+   as well when a block cache of an earlier run is given, every block start it recorded is followed like
+   the entry point (see blockcache.h).
+
+   The translated code returns to the interpreter for one instruction whenever it reaches code it
+   doesn't know. Once the program writes to a word that was translated, every translated instruction
+   checks that its words are still the same before it runs and falls back to the interpreter if not.
+   Every AOT_REVALIDATE_BATCHES batches RAM is compared to the translated words and the checks are
+   dropped again once they all match (the program restored them or was loaded again).
+
+   Translated code doesn't report individual instructions, so it is only used when no callbacks are
+   set and profiling, the heatmap, the block cache and fuzzing are off. Devices mapped over translated code also
+   disable it. */
+
+typedef struct _aot_t aot_t;
+
+#define AOT_BIT(bitmap, address)	((bitmap)[(address) >> 3] & (1 << ((address) & 7)))
+
+#define AOT_REVALIDATE_BATCHES		16
+
+typedef struct _aot_image_t
+{
+	// Hash of the RAM the code was translated from
+	uint64_t hash;
+
+	DCPU16_WORD entry;
+	unsigned instruction_count;
+
+	// Bitmap of the words that belong to translated instructions
+	const unsigned char * code;
+
+	// The words of the bitmap as they were translated, in address order
+	const DCPU16_WORD * words;
+
+	// Runs at most count instructions, returns how many were run
+	unsigned (* run)(aot_t *aot, dcpu16_t *computer, unsigned count);
+
+} aot_image_t;
+
+struct _aot_t
+{
+	const aot_image_t * image;
+
+	// Bitmap of the addresses mapped by devices, updated before every batch
+	unsigned char mapped[DCPU16_RAM_SIZE / 8];
+
+	// Set once translated code (or RAM in general) was written, translated instructions are checked until it's cleared
+	int dirty;
+
+	// Batches run since dirty was set or RAM was last compared to the translated words
+	unsigned dirty_batches;
+};
+
+// Defined by the translated file (only present in emulators built with 'make aot')
+extern const aot_image_t aot_image;
+
+uint64_t aot_hash_image(const dcpu16_t *computer);
+unsigned aot_translate(const dcpu16_t *computer, DCPU16_WORD entry, const struct _blockcache_t *profile, const char *file);
+int aot_init(aot_t *aot, dcpu16_t *computer, const aot_image_t *image);
+void aot_invalidate(aot_t *aot);
+int aot_prepare(aot_t *aot, dcpu16_t *computer);
+DCPU16_WORD aot_device_read(dcpu16_t *computer, DCPU16_WORD address);
+void aot_device_write(dcpu16_t *computer, DCPU16_WORD address, DCPU16_WORD value);
+
+/* Called by the interpreter for every RAM write, translated code has to be checked once it was written. */
+static inline void aot_ram_written(aot_t *aot, DCPU16_WORD address)
+{
+	if(AOT_BIT(aot->image->code, address))
+		aot->dirty = 1;
+}
+
+/* Runs translated code from the current PC, returns the number of instructions run. Returns early
+   (possibly 0) when the next instruction has to be interpreted. */
+static inline unsigned aot_run(aot_t *aot, dcpu16_t *computer, unsigned count)
+{
+	return aot->image->run(aot, computer, count);
+}
+
+/* Used by the translated code. The registers, PC and counters live in local variables while it runs
+   and are only written back before device accesses and when it returns. */
+
+#define AOT_DECLARE_STATE() \
+	DCPU16_WORD * const ram = computer->ram; \
+	DCPU16_WORD a, b, c, x, y, z, i, j, pc, sp, o; \
+	unsigned long long instructions = computer->stats.instructions, cycles = computer->stats.cycles, wakeup; \
+	unsigned n = 0; \
+	int dirty
+
+#define AOT_LOAD_STATE() do { \
+	a = computer->registers[DCPU16_INDEX_REG_A]; b = computer->registers[DCPU16_INDEX_REG_B]; \
+	c = computer->registers[DCPU16_INDEX_REG_C]; x = computer->registers[DCPU16_INDEX_REG_X]; \
+	y = computer->registers[DCPU16_INDEX_REG_Y]; z = computer->registers[DCPU16_INDEX_REG_Z]; \
+	i = computer->registers[DCPU16_INDEX_REG_I]; j = computer->registers[DCPU16_INDEX_REG_J]; \
+	pc = computer->registers[DCPU16_INDEX_REG_PC]; sp = computer->registers[DCPU16_INDEX_REG_SP]; \
+	o = computer->registers[DCPU16_INDEX_REG_O]; \
+	wakeup = computer->wakeup_cycle; \
+	dirty = aot->dirty; \
+} while(0)
+
+#define AOT_SAVE_STATE() do { \
+	computer->registers[DCPU16_INDEX_REG_A] = a; computer->registers[DCPU16_INDEX_REG_B] = b; \
+	computer->registers[DCPU16_INDEX_REG_C] = c; computer->registers[DCPU16_INDEX_REG_X] = x; \
+	computer->registers[DCPU16_INDEX_REG_Y] = y; computer->registers[DCPU16_INDEX_REG_Z] = z; \
+	computer->registers[DCPU16_INDEX_REG_I] = i; computer->registers[DCPU16_INDEX_REG_J] = j; \
+	computer->registers[DCPU16_INDEX_REG_PC] = pc; computer->registers[DCPU16_INDEX_REG_SP] = sp; \
+	computer->registers[DCPU16_INDEX_REG_O] = o; \
+	computer->stats.instructions = instructions + n; \
+	computer->stats.cycles = cycles; \
+	aot->dirty = dirty; \
+} while(0)
+
+// Leaves the translated code before the instruction at address if its words (the condition) changed
+#define AOT_CHECK(address, condition) do { \
+	if(dirty && !(condition)) { \
+		pc = (address); \
+		goto out; \
+	} \
+} while(0)
+
+// Same as dcpu16_get for RAM
+#define AOT_GET(value, address) do { \
+	DCPU16_WORD _address = (address); \
+	if(AOT_BIT(aot->mapped, _address)) { \
+		AOT_SAVE_STATE(); \
+		value = aot_device_read(computer, _address); \
+		AOT_LOAD_STATE(); \
+	} else { \
+		value = ram[_address]; \
+	} \
+} while(0)
+
+// Same as dcpu16_set for RAM
+#define AOT_SET(address, value) do { \
+	DCPU16_WORD _address = (address), _value = (value); \
+	if(AOT_BIT(aot->mapped, _address)) { \
+		AOT_SAVE_STATE(); \
+		aot_device_write(computer, _address, _value); \
+		AOT_LOAD_STATE(); \
+	} else { \
+		ram[_address] = _value; \
+		if(AOT_BIT(aot_code, _address)) \
+			dirty = 1; \
+	} \
+} while(0)
+
+// JSR writes the return address straight into RAM
+#define AOT_PUSH_PC() do { \
+	sp--; \
+	ram[sp] = pc; \
+	if(AOT_BIT(aot_code, sp)) \
+		dirty = 1; \
+} while(0)
+
+// Counts the instruction and leaves once the batch is done or a device wants to be called
+#define AOT_END(instruction_cycles) do { \
+	n++; \
+	cycles += (instruction_cycles); \
+	if(n >= count || cycles >= wakeup) \
+		goto out; \
+} while(0)
+
+// Counts the instruction and stops the emulator (the instruction jumped to itself)
+#define AOT_HALT(instruction_cycles) do { \
+	n++; \
+	cycles += (instruction_cycles); \
+	computer->stats.halts++; \
+	computer->stop_reason = DCPU16_STOP_HALT; \
+	goto out; \
+} while(0)
+
+#endif // AOT_H
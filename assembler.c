@@ -0,0 +1,1017 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "assembler.h"
+
+typedef struct _assembler_name_t
+{
+	const char * name;
+	unsigned char value;
+} assembler_name_t;
+
+static const assembler_name_t assembler_opcodes[] = {
+	{ "SET", DCPU16_OPCODE_SET }, { "ADD", DCPU16_OPCODE_ADD }, { "SUB", DCPU16_OPCODE_SUB }, { "MUL", DCPU16_OPCODE_MUL },
+	{ "DIV", DCPU16_OPCODE_DIV }, { "MOD", DCPU16_OPCODE_MOD }, { "SHL", DCPU16_OPCODE_SHL }, { "SHR", DCPU16_OPCODE_SHR },
+	{ "AND", DCPU16_OPCODE_AND }, { "BOR", DCPU16_OPCODE_BOR }, { "XOR", DCPU16_OPCODE_XOR }, { "IFE", DCPU16_OPCODE_IFE },
+	{ "IFN", DCPU16_OPCODE_IFN }, { "IFG", DCPU16_OPCODE_IFG }, { "IFB", DCPU16_OPCODE_IFB },
+	{ "JSR", DCPU16_OPCODE_NON_BASIC }, { "DAT", ASSEMBLER_DIRECTIVE_DAT }, { 0, 0 }
+};
+
+static const assembler_name_t assembler_registers[] = {
+	{ "A", DCPU16_AB_VALUE_REG_A }, { "B", DCPU16_AB_VALUE_REG_B }, { "C", DCPU16_AB_VALUE_REG_C }, { "X", DCPU16_AB_VALUE_REG_X },
+	{ "Y", DCPU16_AB_VALUE_REG_Y }, { "Z", DCPU16_AB_VALUE_REG_Z }, { "I", DCPU16_AB_VALUE_REG_I }, { "J", DCPU16_AB_VALUE_REG_J },
+	{ 0, 0 }
+};
+
+static const assembler_name_t assembler_special_values[] = {
+	{ "SP", DCPU16_AB_VALUE_REG_SP }, { "PC", DCPU16_AB_VALUE_REG_PC }, { "O", DCPU16_AB_VALUE_REG_O },
+	{ "POP", DCPU16_AB_VALUE_POP }, { "PEEK", DCPU16_AB_VALUE_PEEK }, { "PUSH", DCPU16_AB_VALUE_PUSH },
+	{ "[SP++]", DCPU16_AB_VALUE_POP }, { "[SP]", DCPU16_AB_VALUE_PEEK }, { "[--SP]", DCPU16_AB_VALUE_PUSH },
+	{ 0, 0 }
+};
+
+/* Looks up a name (case insensitive, len characters long). Returns the index in the table or -1. */
+static int assembler_find_name(const assembler_name_t *table, const char *s, size_t len)
+{
+	for(int i = 0; table[i].name; i++) {
+		if(strlen(table[i].name) != len)
+			continue;
+
+		size_t c = 0;
+		while(c < len && toupper((unsigned char)s[c]) == table[i].name[c])
+			c++;
+
+		if(c == len)
+			return i;
+	}
+
+	return -1;
+}
+
+static unsigned assembler_hash_text(const char *s)
+{
+	unsigned hash = 2166136261u;
+
+	for(; *s; s++)
+		hash = (hash ^ (unsigned char)*s) * 16777619u;
+
+	return hash;
+}
+
+static int assembler_is_name_start(char c)
+{
+	return isalpha((unsigned char)c) || c == '_' || c == '.';
+}
+
+static int assembler_is_name_char(char c)
+{
+	return isalnum((unsigned char)c) || c == '_' || c == '.';
+}
+
+/* Trims white space from both ends of s[0..*len). Returns the new start. */
+static const char *assembler_trim(const char *s, size_t *len)
+{
+	while(*len && isspace((unsigned char)*s)) {
+		s++;
+		(*len)--;
+	}
+
+	while(*len && isspace((unsigned char)s[*len - 1]))
+		(*len)--;
+
+	return s;
+}
+
+/* Returns the index of the symbol with the given name, adding it if it doesn't exist (or -1 if out of memory). */
+static int assembler_intern(assembler_t *assembler, const char *name, size_t len)
+{
+	if(len >= ASSEMBLER_MAX_NAME)
+		len = ASSEMBLER_MAX_NAME - 1;
+
+	for(unsigned i = 0; i < assembler->symbol_count; i++) {
+		if(strncmp(assembler->symbols[i].name, name, len) == 0 && assembler->symbols[i].name[len] == 0)
+			return i;
+	}
+
+	if(assembler->symbol_count == assembler->symbol_capacity) {
+		unsigned capacity = assembler->symbol_capacity ? assembler->symbol_capacity * 2 : 64;
+		assembler_symbol_t *symbols = realloc(assembler->symbols, capacity * sizeof(assembler_symbol_t));
+
+		if(!symbols)
+			return -1;
+
+		assembler->symbols = symbols;
+		assembler->symbol_capacity = capacity;
+	}
+
+	assembler_symbol_t *symbol = &assembler->symbols[assembler->symbol_count];
+	memcpy(symbol->name, name, len);
+	symbol->name[len] = 0;
+	symbol->value = 0;
+	symbol->line = -1;
+
+	return assembler->symbol_count++;
+}
+
+/* Records a parse error for the line. Always returns 0. */
+static int assembler_line_error(assembler_line_t *line, const char *message, const char *s, size_t len)
+{
+	char buffer[ASSEMBLER_MAX_ERROR];
+
+	if(s)
+		snprintf(buffer, sizeof(buffer), "%s '%.*s'", message, (int)len, s);
+	else
+		snprintf(buffer, sizeof(buffer), "%s", message);
+
+	free(line->error);
+	line->error = malloc(strlen(buffer) + 1);
+	if(line->error)
+		strcpy(line->error, buffer);
+
+	return 0;
+}
+
+/* Parses a sum of terms. If reg is set a single general register may be one of the (added) terms.
+   Returns true on success. */
+static int assembler_parse_terms(assembler_t *assembler, assembler_line_t *line, const char *s, size_t len,
+				 assembler_expression_t *expression, int *reg)
+{
+	const char *end = s + len;
+	int terms = 0;
+
+	expression->constant = 0;
+	expression->symbol = -1;
+
+	while(s < end) {
+		// Sign
+		int sign = 1;
+		while(s < end && isspace((unsigned char)*s))
+			s++;
+
+		if(terms > 0) {
+			if(s < end && (*s == '+' || *s == '-')) {
+				sign = *s == '-' ? -1 : 1;
+				s++;
+			} else {
+				return assembler_line_error(line, "expected + or - in", s, end - s);
+			}
+		} else if(s < end && *s == '-') {
+			sign = -1;
+			s++;
+		}
+
+		while(s < end && isspace((unsigned char)*s))
+			s++;
+
+		if(s >= end)
+			return assembler_line_error(line, "missing term", 0, 0);
+
+		// Term
+		if(isdigit((unsigned char)*s)) {
+			const char *digits = s;
+			char *number_end;
+			long value;
+
+			if(end - s > 2 && s[0] == '0' && (s[1] == 'b' || s[1] == 'B')) {
+				digits = s + 2;
+				value = strtol(digits, &number_end, 2);
+			} else if(end - s > 2 && s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) {
+				digits = s + 2;
+				value = strtol(digits, &number_end, 16);
+			} else {
+				value = strtol(s, &number_end, 10);
+			}
+
+			// strtol would skip spaces and take a sign after the prefix
+			if(number_end == digits || !isxdigit((unsigned char)*digits) || number_end > end ||
+			   assembler_is_name_char(*number_end))
+				return assembler_line_error(line, "bad number", s, end - s);
+
+			// Values wrap to 16 bits, but a literal that doesn't fit in a word is a mistake
+			if(value > 0xFFFF || (sign < 0 && value > 0x8000))
+				return assembler_line_error(line, "number doesn't fit in a word", s, number_end - s);
+
+			expression->constant += sign * value;
+			s = number_end;
+		} else if(*s == '\'' && end - s >= 3 && s[2] == '\'') {
+			expression->constant += sign * (unsigned char)s[1];
+			s += 3;
+		} else if(assembler_is_name_start(*s)) {
+			const char *name = s;
+			while(s < end && assembler_is_name_char(*s))
+				s++;
+
+			int r = assembler_find_name(assembler_registers, name, s - name);
+
+			if(r >= 0 && reg) {
+				if(*reg >= 0 || sign < 0)
+					return assembler_line_error(line, "bad register use in", name, end - name);
+
+				*reg = assembler_registers[r].value;
+			} else if(r >= 0 || assembler_find_name(assembler_special_values, name, s - name) >= 0) {
+				return assembler_line_error(line, "register not allowed here", name, s - name);
+			} else {
+				if(expression->symbol >= 0 || sign < 0)
+					return assembler_line_error(line, "only one added label is allowed in", name, end - name);
+
+				expression->symbol = assembler_intern(assembler, name, s - name);
+				if(expression->symbol < 0)
+					return assembler_line_error(line, "out of memory", 0, 0);
+			}
+		} else {
+			return assembler_line_error(line, "unexpected", s, end - s);
+		}
+
+		terms++;
+	}
+
+	if(!terms)
+		return assembler_line_error(line, "missing value", 0, 0);
+
+	return 1;
+}
+
+/* Parses one instruction operand. Returns true on success. */
+static int assembler_parse_operand(assembler_t *assembler, assembler_line_t *line, const char *s, size_t len, assembler_operand_t *operand)
+{
+	s = assembler_trim(s, &len);
+	memset(operand, 0, sizeof(*operand));
+	operand->expression.symbol = -1;
+
+	if(!len)
+		return assembler_line_error(line, "missing operand", 0, 0);
+
+	// Registers and other fixed values
+	int special = assembler_find_name(assembler_special_values, s, len);
+	int r = assembler_find_name(assembler_registers, s, len);
+
+	if(special >= 0 || r >= 0) {
+		operand->kind = ASSEMBLER_OPERAND_CODE;
+		operand->code = special >= 0 ? assembler_special_values[special].value : assembler_registers[r].value;
+		return 1;
+	}
+
+	// Memory
+	if(s[0] == '[') {
+		if(s[len - 1] != ']')
+			return assembler_line_error(line, "missing ] in", s, len);
+
+		size_t inner_len = len - 2;
+		const char *inner = assembler_trim(s + 1, &inner_len);
+		int reg = -1;
+
+		if(!assembler_parse_terms(assembler, line, inner, inner_len, &operand->expression, &reg))
+			return 0;
+
+		// [reg] parses as a term of 0 + reg
+		if(reg >= 0 && assembler_find_name(assembler_registers, inner, inner_len) >= 0) {
+			operand->kind = ASSEMBLER_OPERAND_CODE;
+			operand->code = DCPU16_AB_VALUE_PTR_REG_A + reg;
+		} else if(reg >= 0) {
+			operand->kind = ASSEMBLER_OPERAND_PTR_REG_PLUS;
+			operand->code = reg;
+		} else {
+			operand->kind = ASSEMBLER_OPERAND_PTR;
+		}
+
+		return 1;
+	}
+
+	// Literal, constants that fit are embedded in the instruction
+	if(!assembler_parse_terms(assembler, line, s, len, &operand->expression, 0))
+		return 0;
+
+	operand->kind = ASSEMBLER_OPERAND_LITERAL;
+	operand->short_literal = operand->expression.symbol < 0 && (DCPU16_WORD)operand->expression.constant <= 0x1F;
+
+	return 1;
+}
+
+/* Adds a DAT value to the line. Returns true on success. */
+static int assembler_add_data(assembler_line_t *line, int constant, int symbol)
+{
+	if((line->data_count & (line->data_count - 1)) == 0) {
+		unsigned capacity = line->data_count ? line->data_count * 2 : 1;
+		assembler_expression_t *data = realloc(line->data, capacity * sizeof(assembler_expression_t));
+
+		if(!data)
+			return assembler_line_error(line, "out of memory", 0, 0);
+
+		line->data = data;
+	}
+
+	line->data[line->data_count].constant = constant;
+	line->data[line->data_count].symbol = symbol;
+	line->data_count++;
+
+	return 1;
+}
+
+/* Parses a DAT argument (a string or a value). Returns true on success. */
+static int assembler_parse_data(assembler_t *assembler, assembler_line_t *line, const char *s, size_t len)
+{
+	s = assembler_trim(s, &len);
+
+	if(len >= 2 && s[0] == '"' && s[len - 1] == '"') {
+		for(size_t i = 1; i < len - 1; i++) {
+			int c = (unsigned char)s[i];
+
+			if(c == '\\' && i + 1 < len - 1) {
+				c = (unsigned char)s[++i];
+				c = c == 'n' ? '\n' : c == 't' ? '\t' : c == '0' ? 0 : c;
+			}
+
+			if(!assembler_add_data(line, c, -1))
+				return 0;
+		}
+
+		return 1;
+	}
+
+	assembler_expression_t expression;
+	if(!assembler_parse_terms(assembler, line, s, len, &expression, 0))
+		return 0;
+
+	return assembler_add_data(line, expression.constant, expression.symbol);
+}
+
+/* Parses one line of source. Returns true on success, otherwise line->error is set. */
+static int assembler_parse_line(assembler_t *assembler, assembler_line_t *line)
+{
+	line->label = -1;
+	line->opcode = ASSEMBLER_DIRECTIVE_NONE;
+	line->a.expression.symbol = -1;
+	line->b.expression.symbol = -1;
+
+	// Strip the comment (but not a ; inside quotes)
+	size_t len = 0;
+	char quote = 0;
+	for(; line->text[len]; len++) {
+		char c = line->text[len];
+
+		if(quote) {
+			if(c == '\\' && line->text[len + 1])
+				len++;
+			else if(c == quote)
+				quote = 0;
+		} else if(c == '"' || c == '\'') {
+			quote = c;
+		} else if(c == ';') {
+			break;
+		}
+	}
+
+	const char *s = assembler_trim(line->text, &len);
+	const char *end = s + len;
+
+	// Label (:label or label:)
+	if(s < end && *s == ':') {
+		const char *name = ++s;
+		while(s < end && assembler_is_name_char(*s))
+			s++;
+
+		if(s == name || !assembler_is_name_start(*name))
+			return assembler_line_error(line, "bad label", name, end - name);
+
+		line->label = assembler_intern(assembler, name, s - name);
+	} else {
+		const char *name_end = s;
+		while(name_end < end && assembler_is_name_char(*name_end))
+			name_end++;
+
+		if(name_end > s && name_end < end && *name_end == ':' && assembler_is_name_start(*s)) {
+			line->label = assembler_intern(assembler, s, name_end - s);
+			s = name_end + 1;
+		}
+	}
+
+	len = end - s;
+	s = assembler_trim(s, &len);
+
+	if(!len)
+		return 1;
+
+	// Mnemonic
+	const char *mnemonic = s;
+	while(s < end && isalpha((unsigned char)*s))
+		s++;
+
+	int op = assembler_find_name(assembler_opcodes, mnemonic, s - mnemonic);
+	if(op < 0)
+		return assembler_line_error(line, "unknown instruction", mnemonic, s - mnemonic);
+
+	line->opcode = assembler_opcodes[op].value;
+
+	// Split the arguments on commas outside of quotes and brackets
+	const char *args[3];
+	size_t arg_len[3];
+	unsigned arg_count = 0;
+	const char *arg = s;
+	int depth = 0;
+	quote = 0;
+
+	for(const char *p = s; ; p++) {
+		if(p < end && quote) {
+			if(*p == '\\' && p + 1 < end)
+				p++;
+			else if(*p == quote)
+				quote = 0;
+			continue;
+		}
+
+		if(p < end && (*p == '"' || *p == '\'')) {
+			quote = *p;
+		} else if(p < end && *p == '[') {
+			depth++;
+		} else if(p < end && *p == ']') {
+			depth--;
+		} else if(p == end || (*p == ',' && depth == 0)) {
+			size_t l = p - arg;
+			const char *a = assembler_trim(arg, &l);
+
+			if(line->opcode == ASSEMBLER_DIRECTIVE_DAT) {
+				if(!l)
+					return assembler_line_error(line, "missing DAT value", 0, 0);
+				if(!assembler_parse_data(assembler, line, a, l))
+					return 0;
+			} else if(l || p != end || arg_count) {
+				if(arg_count == 2)
+					return assembler_line_error(line, "too many operands", 0, 0);
+
+				args[arg_count] = a;
+				arg_len[arg_count++] = l;
+			}
+
+			if(p == end)
+				break;
+
+			arg = p + 1;
+		}
+	}
+
+	if(line->opcode == ASSEMBLER_DIRECTIVE_DAT)
+		return 1;
+
+	if(line->opcode == DCPU16_OPCODE_NON_BASIC) {
+		if(arg_count != 1)
+			return assembler_line_error(line, "JSR takes one operand", 0, 0);
+
+		line->non_basic_opcode = DCPU16_NON_BASIC_OPCODE_JSR_A;
+		return assembler_parse_operand(assembler, line, args[0], arg_len[0], &line->a);
+	}
+
+	if(arg_count != 2)
+		return assembler_line_error(line, "expected two operands", 0, 0);
+
+	return assembler_parse_operand(assembler, line, args[0], arg_len[0], &line->a) &&
+		assembler_parse_operand(assembler, line, args[1], arg_len[1], &line->b);
+}
+
+static void assembler_free_line(assembler_line_t *line)
+{
+	free(line->text);
+	free(line->data);
+	free(line->error);
+}
+
+void assembler_init(assembler_t *assembler, const char *file)
+{
+	memset(assembler, 0, sizeof(*assembler));
+
+	assembler->file = file;
+	assembler->modified_seconds = -1;
+}
+
+void assembler_release(assembler_t *assembler)
+{
+	for(unsigned i = 0; i < assembler->line_count; i++)
+		assembler_free_line(&assembler->lines[i]);
+
+	free(assembler->lines);
+	free(assembler->symbols);
+	free(assembler->sorted_symbols);
+
+	memset(assembler, 0, sizeof(*assembler));
+}
+
+static DCPU16_WORD assembler_evaluate(const assembler_t *assembler, const assembler_expression_t *expression)
+{
+	int value = expression->constant;
+
+	if(expression->symbol >= 0)
+		value += assembler->symbols[expression->symbol].value;
+
+	return (DCPU16_WORD)value;
+}
+
+static unsigned assembler_operand_size(const assembler_operand_t *operand)
+{
+	switch(operand->kind) {
+	case ASSEMBLER_OPERAND_PTR_REG_PLUS:
+	case ASSEMBLER_OPERAND_PTR:
+		return 1;
+	case ASSEMBLER_OPERAND_LITERAL:
+		return operand->short_literal ? 0 : 1;
+	};
+
+	return 0;
+}
+
+static unsigned assembler_line_size(const assembler_line_t *line)
+{
+	if(line->relative_jump)
+		return 1;
+	if(line->opcode == ASSEMBLER_DIRECTIVE_DAT)
+		return line->data_count;
+	if(line->opcode == DCPU16_OPCODE_NON_BASIC)
+		return 1 + assembler_operand_size(&line->a);
+	if(line->opcode != ASSEMBLER_DIRECTIVE_NONE)
+		return 1 + assembler_operand_size(&line->a) + assembler_operand_size(&line->b);
+
+	return 0;
+}
+
+/* Assigns addresses to all lines and labels. Returns the total size in words. */
+static unsigned assembler_layout(assembler_t *assembler)
+{
+	unsigned address = 0;
+
+	for(unsigned i = 0; i < assembler->line_count; i++) {
+		assembler_line_t *line = &assembler->lines[i];
+
+		line->address = address;
+		line->size = assembler_line_size(line);
+
+		if(line->label >= 0)
+			assembler->symbols[line->label].value = address;
+
+		address += line->size;
+	}
+
+	return address;
+}
+
+/* Picks the short form for label literals that fit. Returns true if anything changed. */
+static int assembler_shrink_operand(const assembler_t *assembler, assembler_operand_t *operand)
+{
+	if(operand->kind != ASSEMBLER_OPERAND_LITERAL || operand->expression.symbol < 0)
+		return 0;
+
+	unsigned char short_literal = assembler_evaluate(assembler, &operand->expression) <= 0x1F;
+	if(short_literal == operand->short_literal)
+		return 0;
+
+	operand->short_literal = short_literal;
+	return 1;
+}
+
+/* Returns the distance from the instruction after line to the target of its SET PC, as a 16 bit value. */
+static DCPU16_WORD assembler_jump_distance(const assembler_t *assembler, const assembler_line_t *line)
+{
+	return assembler_evaluate(assembler, &line->b.expression) - (DCPU16_WORD)(line->address + 1);
+}
+
+/* Picks ADD/SUB PC, distance for SET PC, expr when the distance fits a short literal and the target
+   itself doesn't. Returns true if anything changed. */
+static int assembler_shrink_jump(const assembler_t *assembler, assembler_line_t *line)
+{
+	if(line->opcode != DCPU16_OPCODE_SET || line->a.kind != ASSEMBLER_OPERAND_CODE ||
+	   line->a.code != DCPU16_AB_VALUE_REG_PC || line->b.kind != ASSEMBLER_OPERAND_LITERAL)
+		return 0;
+
+	unsigned char relative_jump = 0;
+	if(!line->b.short_literal) {
+		DCPU16_WORD distance = assembler_jump_distance(assembler, line);
+		relative_jump = distance <= 0x1F || distance >= (DCPU16_WORD)-0x1F;
+	}
+
+	if(relative_jump == line->relative_jump)
+		return 0;
+
+	line->relative_jump = relative_jump;
+	return 1;
+}
+
+/* Returns the AB value of the operand and stores the extra word (if any) in *next. */
+static unsigned char assembler_encode_operand(const assembler_t *assembler, const assembler_operand_t *operand, DCPU16_WORD *next)
+{
+	switch(operand->kind) {
+	case ASSEMBLER_OPERAND_PTR_REG_PLUS:
+		*next = assembler_evaluate(assembler, &operand->expression);
+		return DCPU16_AB_VALUE_PTR_REG_A_PLUS_WORD + operand->code;
+	case ASSEMBLER_OPERAND_PTR:
+		*next = assembler_evaluate(assembler, &operand->expression);
+		return DCPU16_AB_VALUE_PTR_WORD;
+	case ASSEMBLER_OPERAND_LITERAL:
+		if(operand->short_literal)
+			return 0x20 + assembler_evaluate(assembler, &operand->expression);
+
+		*next = assembler_evaluate(assembler, &operand->expression);
+		return DCPU16_AB_VALUE_WORD;
+	};
+
+	return operand->code;
+}
+
+/* Returns the symbol of an expression that refers to an undefined label, or -1. */
+static int assembler_undefined_symbol(const assembler_t *assembler, const assembler_expression_t *expression)
+{
+	if(expression->symbol >= 0 && assembler->symbols[expression->symbol].line < 0)
+		return expression->symbol;
+
+	return -1;
+}
+
+/* Sorts the defined symbols by value. */
+static void assembler_sort_symbols(assembler_t *assembler)
+{
+	free(assembler->sorted_symbols);
+	assembler->sorted_symbols = malloc((assembler->symbol_count ? assembler->symbol_count : 1) * sizeof(int));
+	assembler->sorted_symbol_count = 0;
+
+	if(!assembler->sorted_symbols)
+		return;
+
+	// Insertion sort, lines (and so labels) are mostly in address order already
+	for(unsigned i = 0; i < assembler->symbol_count; i++) {
+		if(assembler->symbols[i].line < 0)
+			continue;
+
+		unsigned j = assembler->sorted_symbol_count++;
+		while(j > 0 && assembler->symbols[assembler->sorted_symbols[j - 1]].value > assembler->symbols[i].value) {
+			assembler->sorted_symbols[j] = assembler->sorted_symbols[j - 1];
+			j--;
+		}
+
+		assembler->sorted_symbols[j] = i;
+	}
+}
+
+/* Reads the source into memory. Returns 0 on failure. */
+static char *assembler_read_source(assembler_t *assembler)
+{
+	struct stat st;
+	if(stat(assembler->file, &st) != 0)
+		return 0;
+
+	assembler->modified_seconds = st.st_mtim.tv_sec;
+	assembler->modified_nanoseconds = st.st_mtim.tv_nsec;
+	assembler->file_size = st.st_size;
+
+	FILE *f = fopen(assembler->file, "rb");
+	if(!f)
+		return 0;
+
+	char *source = malloc(st.st_size + 1);
+	size_t size = source ? fread(source, 1, st.st_size, f) : 0;
+	fclose(f);
+
+	if(source)
+		source[size] = 0;
+
+	return source;
+}
+
+/* Finds lines that didn't change since the last assembly and parses the rest. Returns true on success. */
+static int assembler_update_lines(assembler_t *assembler, char *source)
+{
+	// Split into lines
+	unsigned count = 1;
+	for(char *p = source; *p; p++) {
+		if(*p == '\n')
+			count++;
+	}
+
+	assembler_line_t *lines = calloc(count, sizeof(assembler_line_t));
+	if(!lines)
+		return 0;
+
+	// Index the old lines by the hash of their text
+	unsigned table_size = 1;
+	while(table_size < assembler->line_count * 2)
+		table_size *= 2;
+
+	int *table = malloc(table_size * sizeof(int));
+	if(!table) {
+		free(lines);
+		return 0;
+	}
+
+	memset(table, -1, table_size * sizeof(int));
+
+	for(unsigned i = 0; i < assembler->line_count; i++) {
+		unsigned slot = assembler->lines[i].hash & (table_size - 1);
+		while(table[slot] >= 0)
+			slot = (slot + 1) & (table_size - 1);
+
+		table[slot] = i;
+	}
+
+	// Reuse old lines with the same text, parse the others
+	char *line_start = source;
+	assembler->lines_parsed = 0;
+
+	for(unsigned n = 0; n < count; n++) {
+		char *line_end = strchr(line_start, '\n');
+		if(line_end)
+			*line_end = 0;
+
+		size_t len = strlen(line_start);
+		if(len && line_start[len - 1] == '\r')
+			line_start[--len] = 0;
+
+		unsigned hash = assembler_hash_text(line_start);
+		unsigned slot = hash & (table_size - 1);
+		int reused = 0;
+
+		for(; assembler->line_count && table[slot] != -1; slot = (slot + 1) & (table_size - 1)) {
+			assembler_line_t *old = &assembler->lines[table[slot]];
+
+			// Lines already taken have their text set to 0
+			if(old->text && old->hash == hash && strcmp(old->text, line_start) == 0) {
+				lines[n] = *old;
+				old->text = 0;
+				old->data = 0;
+				old->error = 0;
+				reused = 1;
+				break;
+			}
+		}
+
+		if(!reused) {
+			lines[n].text = malloc(len + 1);
+			lines[n].hash = hash;
+
+			if(lines[n].text) {
+				memcpy(lines[n].text, line_start, len + 1);
+				assembler_parse_line(assembler, &lines[n]);
+			} else {
+				lines[n].label = -1;
+				lines[n].opcode = ASSEMBLER_DIRECTIVE_NONE;
+				assembler_line_error(&lines[n], "out of memory", 0, 0);
+			}
+
+			assembler->lines_parsed++;
+		}
+
+		line_start = line_end ? line_end + 1 : line_start + len;
+	}
+
+	free(table);
+
+	for(unsigned i = 0; i < assembler->line_count; i++)
+		assembler_free_line(&assembler->lines[i]);
+
+	free(assembler->lines);
+	assembler->lines = lines;
+	assembler->line_count = count;
+
+	return 1;
+}
+
+/* Returns false and sets the error message. */
+static int assembler_error(assembler_t *assembler, unsigned line, const char *message, const char *name)
+{
+	snprintf(assembler->error, sizeof(assembler->error), "%s:%u: %s%s%s", assembler->file, line + 1, message,
+		name ? " " : "", name ? name : "");
+
+	return 0;
+}
+
+/* (Re)assembles the source file. Returns true on success, otherwise the error is in assembler->error. */
+int assembler_assemble(assembler_t *assembler)
+{
+	assembler->error[0] = 0;
+
+	char *source = assembler_read_source(assembler);
+	if(!source) {
+		snprintf(assembler->error, sizeof(assembler->error), "%s: couldn't read the file", assembler->file);
+		return 0;
+	}
+
+	int ok = assembler_update_lines(assembler, source);
+	free(source);
+
+	if(!ok) {
+		snprintf(assembler->error, sizeof(assembler->error), "%s: out of memory", assembler->file);
+		return 0;
+	}
+
+	// Parse errors and label definitions
+	for(unsigned i = 0; i < assembler->symbol_count; i++)
+		assembler->symbols[i].line = -1;
+
+	for(unsigned i = 0; i < assembler->line_count; i++) {
+		assembler_line_t *line = &assembler->lines[i];
+
+		if(line->error)
+			return assembler_error(assembler, i, line->error, 0);
+
+		if(line->label >= 0) {
+			if(assembler->symbols[line->label].line >= 0)
+				return assembler_error(assembler, i, "duplicate label", assembler->symbols[line->label].name);
+
+			assembler->symbols[line->label].line = i;
+		}
+	}
+
+	// Undefined labels
+	for(unsigned i = 0; i < assembler->line_count; i++) {
+		assembler_line_t *line = &assembler->lines[i];
+		int undefined = assembler_undefined_symbol(assembler, &line->a.expression);
+
+		if(undefined < 0)
+			undefined = assembler_undefined_symbol(assembler, &line->b.expression);
+
+		for(unsigned d = 0; undefined < 0 && d < line->data_count; d++)
+			undefined = assembler_undefined_symbol(assembler, &line->data[d]);
+
+		if(line->opcode != ASSEMBLER_DIRECTIVE_NONE && undefined >= 0)
+			return assembler_error(assembler, i, "undefined label", assembler->symbols[undefined].name);
+	}
+
+	// Layout, label literals and jumps start out long and are shrunk until nothing changes
+	for(unsigned i = 0; i < assembler->line_count; i++) {
+		assembler_line_t *line = &assembler->lines[i];
+
+		line->relative_jump = 0;
+
+		if(line->a.kind == ASSEMBLER_OPERAND_LITERAL && line->a.expression.symbol >= 0)
+			line->a.short_literal = 0;
+		if(line->b.kind == ASSEMBLER_OPERAND_LITERAL && line->b.expression.symbol >= 0)
+			line->b.short_literal = 0;
+	}
+
+	unsigned size = assembler_layout(assembler);
+
+	for(int pass = 0; ; pass++) {
+		int changed = 0;
+
+		for(unsigned i = 0; i < assembler->line_count; i++) {
+			changed |= assembler_shrink_operand(assembler, &assembler->lines[i].a);
+			changed |= assembler_shrink_operand(assembler, &assembler->lines[i].b);
+			changed |= assembler_shrink_jump(assembler, &assembler->lines[i]);
+		}
+
+		if(!changed)
+			break;
+
+		// Labels that move backwards past 0 could make the sizes oscillate, give up and use long literals
+		if(pass == ASSEMBLER_MAX_LAYOUT_PASSES) {
+			for(unsigned i = 0; i < assembler->line_count; i++) {
+				if(assembler->lines[i].a.expression.symbol >= 0)
+					assembler->lines[i].a.short_literal = 0;
+				if(assembler->lines[i].b.expression.symbol >= 0)
+					assembler->lines[i].b.short_literal = 0;
+				assembler->lines[i].relative_jump = 0;
+			}
+
+			size = assembler_layout(assembler);
+			break;
+		}
+
+		size = assembler_layout(assembler);
+	}
+
+	if(size > DCPU16_RAM_SIZE) {
+		snprintf(assembler->error, sizeof(assembler->error), "%s: program too large (%u words)", assembler->file, size);
+		return 0;
+	}
+
+	// Emit
+	for(unsigned i = 0; i < assembler->line_count; i++) {
+		const assembler_line_t *line = &assembler->lines[i];
+		DCPU16_WORD *out = &assembler->image[line->address];
+
+		if(line->opcode == ASSEMBLER_DIRECTIVE_DAT) {
+			for(unsigned d = 0; d < line->data_count; d++)
+				*out++ = assembler_evaluate(assembler, &line->data[d]);
+		} else if(line->relative_jump) {
+			DCPU16_WORD distance = assembler_jump_distance(assembler, line);
+
+			if(distance <= 0x1F)
+				*out++ = DCPU16_OPCODE_ADD | (DCPU16_AB_VALUE_REG_PC << 4) | ((0x20 + distance) << 10);
+			else
+				*out++ = DCPU16_OPCODE_SUB | (DCPU16_AB_VALUE_REG_PC << 4) | ((0x20 + (DCPU16_WORD)-distance) << 10);
+		} else if(line->opcode == DCPU16_OPCODE_NON_BASIC) {
+			DCPU16_WORD a_next = 0;
+			unsigned char a = assembler_encode_operand(assembler, &line->a, &a_next);
+
+			*out++ = (line->non_basic_opcode << 4) | (a << 10);
+			if(assembler_operand_size(&line->a))
+				*out++ = a_next;
+		} else if(line->opcode != ASSEMBLER_DIRECTIVE_NONE) {
+			DCPU16_WORD a_next = 0, b_next = 0;
+			unsigned char a = assembler_encode_operand(assembler, &line->a, &a_next);
+			unsigned char b = assembler_encode_operand(assembler, &line->b, &b_next);
+
+			// The CPU reads the extra word of a before the one of b
+			*out++ = line->opcode | (a << 4) | (b << 10);
+			if(assembler_operand_size(&line->a))
+				*out++ = a_next;
+			if(assembler_operand_size(&line->b))
+				*out++ = b_next;
+		}
+	}
+
+	assembler->image_size = size;
+	assembler_sort_symbols(assembler);
+
+	return 1;
+}
+
+/* Clears the registers and RAM of the computer and loads the assembled program. */
+void assembler_load(const assembler_t *assembler, dcpu16_t *computer)
+{
+	memset(computer->registers, 0, sizeof(computer->registers));
+	memset(computer->ram, 0, sizeof(computer->ram));
+	memcpy(computer->ram, assembler->image, assembler->image_size * sizeof(DCPU16_WORD));
+}
+
+/* Writes the assembled program to a binary RAM file (little endian words, see -b). Returns true on success. */
+int assembler_write(const assembler_t *assembler, const char *file)
+{
+	FILE *f = fopen(file, "wb");
+	if(!f)
+		return 0;
+
+	for(unsigned i = 0; i < assembler->image_size; i++) {
+		fputc(assembler->image[i] & 0xFF, f);
+		fputc(assembler->image[i] >> 8, f);
+	}
+
+	return fclose(f) == 0;
+}
+
+/* Returns true if the source file was modified (or removed) since it was last assembled. */
+int assembler_source_changed(assembler_t *assembler)
+{
+	struct stat st;
+	if(stat(assembler->file, &st) != 0)
+		return 1;
+
+	return st.st_mtim.tv_sec != assembler->modified_seconds || st.st_mtim.tv_nsec != assembler->modified_nanoseconds ||
+		st.st_size != assembler->file_size;
+}
+
+/* Sleeps until the source file is modified. Returns false if *interrupted was set or the file was
+   removed (and not saved again within ASSEMBLER_DELETED_POLLS checks, editors may replace it) instead. */
+int assembler_wait_for_change(assembler_t *assembler, const volatile sig_atomic_t *interrupted)
+{
+	struct timespec delay = { 0, ASSEMBLER_POLL_NANOSECONDS };
+	unsigned missing = 0;
+
+	while(!*interrupted) {
+		struct stat st;
+
+		if(stat(assembler->file, &st) != 0) {
+			if(++missing == ASSEMBLER_DELETED_POLLS)
+				return 0;
+		} else {
+			missing = 0;
+
+			if(assembler_source_changed(assembler))
+				return 1;
+		}
+
+		nanosleep(&delay, 0);
+	}
+
+	return 0;
+}
+
+/* Returns the name of the closest label at or before address and the distance to it in *offset, or 0 if there is none. */
+const char *assembler_symbol_at(const assembler_t *assembler, DCPU16_WORD address, DCPU16_WORD *offset)
+{
+	unsigned low = 0, high = assembler->sorted_symbol_count;
+
+	// Find the first symbol with a value above address
+	while(low < high) {
+		unsigned middle = (low + high) / 2;
+
+		if(assembler->symbols[assembler->sorted_symbols[middle]].value <= address)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	if(low == 0)
+		return 0;
+
+	const assembler_symbol_t *symbol = &assembler->symbols[assembler->sorted_symbols[low - 1]];
+	*offset = address - symbol->value;
+
+	return symbol->name;
+}
+
+/* Returns true if the file name looks like assembly source. */
+int assembler_is_source_file(const char *file)
+{
+	size_t len = strlen(file);
+
+	return (len > 7 && strcmp(file + len - 7, ".dasm16") == 0) || (len > 5 && strcmp(file + len - 5, ".dasm") == 0);
+}
@@ -0,0 +1,130 @@
+#ifndef ASSEMBLER_H
+#define ASSEMBLER_H
+
+#include <signal.h>
+#include "dcpu16.h"
+
+/* Assembles DCPU-16 source (e.g. programs/src/prooftest.dasm16) directly into RAM.
+
+   Supported syntax:
+	; comment
+	:label  or  label:
+	SET ADD SUB MUL DIV MOD SHL SHR AND BOR XOR IFE IFN IFG IFB JSR
+	DAT 1, 0x20, 'c', "string", label
+	A B C X Y Z I J SP PC O POP PEEK PUSH [reg] [expr] [expr + reg] [reg + expr] expr
+   where expr is a sum of numbers (decimal, 0x hex, 0b binary, 'c') and at most one label.
+
+   Literals 0-31 are encoded in the instruction word. Labels start out as full words and shrink when
+   their value turns out to be small enough. SET PC, expr is assembled as ADD PC, n or SUB PC, n when
+   the target is at most 31 words away from the next instruction (as other assemblers do, this also
+   changes O).
+
+   Parsed lines are kept between calls to assembler_assemble and only lines whose text changed are
+   parsed again, so reassembling after an edit is cheap. */
+
+#define ASSEMBLER_MAX_LINE			512
+#define ASSEMBLER_MAX_NAME			64
+#define ASSEMBLER_MAX_ERROR			256
+#define ASSEMBLER_MAX_LAYOUT_PASSES		32
+
+// assembler_wait_for_change checks the source every 50 ms and gives up once it has been gone for a second
+#define ASSEMBLER_POLL_NANOSECONDS		50000000
+#define ASSEMBLER_DELETED_POLLS			20
+
+#define ASSEMBLER_OPERAND_NONE			0
+#define ASSEMBLER_OPERAND_CODE			1	// Fixed AB value (registers, POP, PEEK, ...)
+#define ASSEMBLER_OPERAND_PTR_REG_PLUS		2	// [expr + reg]
+#define ASSEMBLER_OPERAND_PTR			3	// [expr]
+#define ASSEMBLER_OPERAND_LITERAL		4	// expr
+
+#define ASSEMBLER_DIRECTIVE_DAT			0xFF
+#define ASSEMBLER_DIRECTIVE_NONE		0xFE	// Empty line (or just a label)
+
+typedef struct _assembler_expression_t
+{
+	int constant;
+	int symbol;	// Index in the symbol table or -1
+} assembler_expression_t;
+
+typedef struct _assembler_operand_t
+{
+	unsigned char kind;
+	unsigned char code;	// AB value for ASSEMBLER_OPERAND_CODE, register index for ASSEMBLER_OPERAND_PTR_REG_PLUS
+	unsigned char short_literal;
+	assembler_expression_t expression;
+} assembler_operand_t;
+
+typedef struct _assembler_line_t
+{
+	// Source text and its hash, used to find lines that didn't change
+	char * text;
+	unsigned hash;
+
+	int label;		// Symbol defined on this line or -1
+	unsigned char opcode;	// DCPU16_OPCODE_*, DCPU16_OPCODE_NON_BASIC for JSR, ASSEMBLER_DIRECTIVE_DAT or ASSEMBLER_DIRECTIVE_NONE
+	unsigned char non_basic_opcode;
+	assembler_operand_t a;
+	assembler_operand_t b;
+
+	// DAT values
+	assembler_expression_t * data;
+	unsigned data_count;
+
+	// Layout
+	DCPU16_WORD address;
+	unsigned size;
+	unsigned char relative_jump;	// SET PC, expr assembled as ADD/SUB PC, distance
+
+	// Set if the line could not be parsed
+	char * error;
+} assembler_line_t;
+
+typedef struct _assembler_symbol_t
+{
+	char name[ASSEMBLER_MAX_NAME];
+	DCPU16_WORD value;
+	int line;		// Line that defines the symbol or -1
+} assembler_symbol_t;
+
+typedef struct _assembler_t
+{
+	const char * file;
+
+	// Modification time and size of the source when it was last read
+	long long modified_seconds;
+	long modified_nanoseconds;
+	long long file_size;
+
+	assembler_line_t * lines;
+	unsigned line_count;
+
+	// Symbols are never removed, lines refer to them by index
+	assembler_symbol_t * symbols;
+	unsigned symbol_count;
+	unsigned symbol_capacity;
+
+	// Defined symbols sorted by value, used for looking up addresses
+	int * sorted_symbols;
+	unsigned sorted_symbol_count;
+
+	DCPU16_WORD image[DCPU16_RAM_SIZE];
+	unsigned image_size;
+
+	// Statistics of the last assembly
+	unsigned lines_parsed;
+
+	char error[ASSEMBLER_MAX_ERROR];
+
+} assembler_t;
+
+void assembler_init(assembler_t *assembler, const char *file);
+void assembler_release(assembler_t *assembler);
+int assembler_assemble(assembler_t *assembler);
+void assembler_load(const assembler_t *assembler, dcpu16_t *computer);
+int assembler_write(const assembler_t *assembler, const char *file);
+int assembler_source_changed(assembler_t *assembler);
+int assembler_wait_for_change(assembler_t *assembler, const volatile sig_atomic_t *interrupted);
+const char *assembler_symbol_at(const assembler_t *assembler, DCPU16_WORD address, DCPU16_WORD *offset);
+int assembler_is_source_file(const char *file);
+
+#endif // ASSEMBLER_H
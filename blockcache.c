@@ -0,0 +1,149 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "blockcache.h"
+
+/* FNV-1a (64-bit) of the whole RAM. */
+static uint64_t blockcache_hash_image(const dcpu16_t *computer)
+{
+	uint64_t hash = 14695981039346656037ull;
+	const unsigned char *p = (const unsigned char *)computer->ram;
+
+	for(unsigned i = 0; i < sizeof(computer->ram); i++)
+		hash = (hash ^ p[i]) * 1099511628211ull;
+
+	return hash;
+}
+
+/* Clears the cache, keys it with the current contents of RAM and attaches it to the computer.
+   Should be called after the program has been loaded. */
+void blockcache_init(blockcache_t *cache, dcpu16_t *computer)
+{
+	memset(cache, 0, sizeof(*cache));
+
+	cache->image_hash = blockcache_hash_image(computer);
+	cache->next_pc = computer->registers[DCPU16_INDEX_REG_PC] - 1;
+	computer->blockcache = cache;
+}
+
+void blockcache_release(blockcache_t *cache, dcpu16_t *computer)
+{
+	if(computer->blockcache == cache)
+		computer->blockcache = 0;
+}
+
+/* Builds the name of the cache file for the attached image. */
+void blockcache_file_name(const blockcache_t *cache, const char *directory, char *file, unsigned size)
+{
+	snprintf(file, size, "%s/%016llx%s", directory, (unsigned long long)cache->image_hash, BLOCKCACHE_FILE_EXTENSION);
+}
+
+/* Adds the block starts of a cache file made for the same image to the cache.
+   Returns true on success, the cache is left untouched if the file is missing or doesn't match. */
+int blockcache_load(blockcache_t *cache, const char *file)
+{
+	int fd = open(file, O_RDONLY);
+	if(fd < 0)
+		return 0;
+
+	struct stat st;
+	if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(blockcache_file_header_t)) {
+		close(fd);
+		return 0;
+	}
+
+	size_t size = st.st_size;
+	void *p = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if(p == MAP_FAILED)
+		return 0;
+
+	const blockcache_file_header_t *header = p;
+	const blockcache_file_block_t *blocks = (const blockcache_file_block_t *)(header + 1);
+
+	int ok = header->magic == BLOCKCACHE_MAGIC && header->version == BLOCKCACHE_VERSION &&
+		header->image_hash == cache->image_hash && header->block_count <= DCPU16_RAM_SIZE &&
+		size >= sizeof(*header) + header->block_count * sizeof(*blocks);
+
+	if(ok) {
+		for(uint32_t i = 0; i < header->block_count; i++) {
+			unsigned *hits = &cache->block_hits[blocks[i].start];
+
+			// Saturate instead of wrapping (a file may list a start more than once)
+			*hits = *hits + blocks[i].hits < *hits ? ~0u : *hits + blocks[i].hits;
+		}
+	}
+
+	munmap(p, size);
+
+	return ok;
+}
+
+/* Used for sorting blocks, hottest first. */
+static int blockcache_compare_blocks(const void *a, const void *b)
+{
+	const blockcache_file_block_t *block_a = a;
+	const blockcache_file_block_t *block_b = b;
+
+	if(block_a->hits != block_b->hits)
+		return block_a->hits < block_b->hits ? 1 : -1;
+
+	return (int)block_a->start - (int)block_b->start;
+}
+
+/* Writes the cache to a file. Returns true on success. */
+int blockcache_save(const blockcache_t *cache, const char *file)
+{
+	blockcache_file_header_t header;
+	memset(&header, 0, sizeof(header));
+	header.magic = BLOCKCACHE_MAGIC;
+	header.version = BLOCKCACHE_VERSION;
+	header.image_hash = cache->image_hash;
+
+	blockcache_file_block_t *blocks = malloc(DCPU16_RAM_SIZE * sizeof(blockcache_file_block_t));
+	if(!blocks)
+		return 0;
+
+	for(unsigned address = 0; address < DCPU16_RAM_SIZE; address++) {
+		if(cache->block_hits[address]) {
+			blockcache_file_block_t *block = &blocks[header.block_count++];
+			block->start = address;
+			block->reserved = 0;
+			block->hits = cache->block_hits[address];
+		}
+	}
+
+	qsort(blocks, header.block_count, sizeof(*blocks), blockcache_compare_blocks);
+
+	// Write to a temporary file first so that other processes never map a half written cache
+	char tmp_file[4096];
+	snprintf(tmp_file, sizeof(tmp_file), "%s.%ld.tmp", file, (long)getpid());
+
+	FILE *f = fopen(tmp_file, "wb");
+	int ok = f != 0;
+
+	if(ok) {
+		fwrite(&header, sizeof(header), 1, f);
+		fwrite(blocks, sizeof(*blocks), header.block_count, f);
+
+		ok = !ferror(f);
+		if(fclose(f) != 0)
+			ok = 0;
+
+		if(ok)
+			ok = rename(tmp_file, file) == 0;
+
+		if(!ok)
+			remove(tmp_file);
+	}
+
+	free(blocks);
+
+	return ok;
+}
@@ -0,0 +1,86 @@
+#ifndef BLOCKCACHE_H
+#define BLOCKCACHE_H
+
+#include <stdint.h>
+#include "dcpu16.h"
+
+/* The block cache counts how often execution entered each address from somewhere else than the previous
+   instruction (a basic block start). That is only known after running the program: jumps through registers,
+   the stack or tables can't be followed statically. The counts are saved to a cache file named after a hash
+   of the program image, and -aot translates the code from every block start in the cache as well as from
+   the entry point. The cache doesn't make the interpreter itself any faster.
+
+   Only instructions run by dcpu16_run are counted, and only while the cache is attached. Counting slows the
+   interpreter down and keeps translated code from running, so only runs that find no cache file for their
+   image attach it; runs that load one leave it detached and don't write it back.
+
+   Cache file layout (native byte order, the file is mapped and read in place):
+
+	blockcache_file_header_t
+	blockcache_file_block_t[block_count]		hottest blocks first */
+
+#define BLOCKCACHE_MAGIC			0x43424344	// "DCBC"
+#define BLOCKCACHE_VERSION			2
+#define BLOCKCACHE_FILE_EXTENSION		".dcache"
+
+typedef struct _blockcache_file_header_t
+{
+	uint32_t magic;
+	uint32_t version;
+	uint64_t image_hash;
+	uint32_t block_count;
+	uint32_t reserved[3];
+} blockcache_file_header_t;
+
+typedef struct _blockcache_file_block_t
+{
+	uint16_t start;
+	uint16_t reserved;
+	uint32_t hits;
+} blockcache_file_block_t;
+
+typedef struct _blockcache_t
+{
+	unsigned block_hits[DCPU16_RAM_SIZE];
+
+	// Address of the instruction following the last one run
+	DCPU16_WORD next_pc;
+
+	// Hash of the RAM when the cache was attached, used as the cache key
+	uint64_t image_hash;
+
+} blockcache_t;
+
+void blockcache_init(blockcache_t *cache, dcpu16_t *computer);
+void blockcache_release(blockcache_t *cache, dcpu16_t *computer);
+void blockcache_file_name(const blockcache_t *cache, const char *directory, char *file, unsigned size);
+int blockcache_load(blockcache_t *cache, const char *file);
+int blockcache_save(const blockcache_t *cache, const char *file);
+
+/* Returns true if the AB value v is followed by an extra word. */
+static inline int blockcache_uses_next_word(unsigned char v)
+{
+	return (v >= DCPU16_AB_VALUE_PTR_REG_A_PLUS_WORD && v <= DCPU16_AB_VALUE_PTR_REG_J_PLUS_WORD) ||
+		v == DCPU16_AB_VALUE_PTR_WORD || v == DCPU16_AB_VALUE_WORD;
+}
+
+/* Returns the length in words of the instruction w. */
+static inline unsigned blockcache_length(DCPU16_WORD w)
+{
+	if((w & 0xF) == DCPU16_OPCODE_NON_BASIC)
+		return 1 + blockcache_uses_next_word((w >> 10) & 0x3F);
+
+	return 1 + blockcache_uses_next_word((w >> 4) & 0x3F) + blockcache_uses_next_word((w >> 10) & 0x3F);
+}
+
+/* Called by dcpu16_run before the instruction w at address runs. Counts a block start if execution
+   didn't simply fall through from the previous instruction. */
+static inline void blockcache_record(blockcache_t *cache, DCPU16_WORD address, DCPU16_WORD w)
+{
+	if(address != cache->next_pc)
+		cache->block_hits[address]++;
+
+	cache->next_pc = address + blockcache_length(w);
+}
+
+#endif // BLOCKCACHE_H
@@ -1,8 +1,21 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <signal.h>
 #define __need_struct_timeval 1
 #include <sys/time.h>
 #include "dcpu16.h"
+#include "fuzz.h"
+#include "metrics.h"
+#include "savestate.h"
+#include "blockcache.h"
+#include "heatmap.h"
+#include "assembler.h"
+#include "aot.h"
+#include "devices/screen/screen.h"
+#include "devices/screen/framebuffer.h"
+#include "devices/keyboard/keyboard.h"
+#include "devices/disk/disk.h"
 
 /* Installs the device and returns a non-negative value on success. The returned value is the index/slot where the device was installed. */
 int dcpu16_install_device(dcpu16_t *computer, dcpu16_device_t *device)
@@ -10,6 +23,7 @@ int dcpu16_install_device(dcpu16_t *computer, dcpu16_device_t *device)
 	for(int slot = 0; slot < DCPU16_DEVICE_SLOTS; slot++) {
 		if(!computer->devices[slot]) {
 			computer->devices[slot] = device;
+			device->computer = computer;
 			return slot;
 		}
 	}
@@ -23,9 +37,16 @@ void dcpu16_uninstall_device(dcpu16_t *computer, int slot)
 		computer->devices[slot] = 0;
 }
 
+/* Makes dcpu16_run end the current batch (and call the device batch functions) once the given cycle count has been reached. */
+void dcpu16_request_wakeup(dcpu16_t *computer, unsigned long long cycle)
+{
+	if(cycle < computer->wakeup_cycle)
+		computer->wakeup_cycle = cycle;
+}
+
 /* Finds the device which is mapped to the specified memory address.
    Returns a pointer to the dcpu16_device_t structure or 0 if the address is unmapped. */
-static dcpu16_device_t * dcpu16_mapped_device(dcpu16_t *computer, DCPU16_WORD address) 
+dcpu16_device_t * dcpu16_mapped_device(dcpu16_t *computer, DCPU16_WORD address) 
 {
 	for(int slot = 0; slot < DCPU16_DEVICE_SLOTS; slot++) {
 		if(computer->devices[slot]) {
@@ -45,9 +66,17 @@ static inline void dcpu16_set(dcpu16_t *computer, DCPU16_WORD *where, DCPU16_WOR
 		// Calculate the RAM address
 		DCPU16_WORD ram_address = where - computer->ram;
 
+		if(computer->heatmap)
+			heatmap_write(computer->heatmap, ram_address);
+
 		// Check for hardware mapped RAM
 		dcpu16_device_t * dev = dcpu16_mapped_device(computer, ram_address);
 		if(dev) {
+			computer->stats.device_writes++;
+
+			if(computer->heatmap)
+				heatmap_device_access(computer->heatmap, computer, dev, 1);
+
 			dev->write(dev, ram_address - dev->ram_start_address, value);
 		} else {
 			// Call the callback function if address was not hardware mapped
@@ -56,6 +85,9 @@ static inline void dcpu16_set(dcpu16_t *computer, DCPU16_WORD *where, DCPU16_WOR
 
 			// Write to RAM
 			*where = value;
+
+			if(computer->aot)
+				aot_ram_written(computer->aot, ram_address);
 		}
 	} else if(where >= computer->registers && where < computer->registers + DCPU16_REGISTER_COUNT) {	// Register
 		// Call the callback function
@@ -64,6 +96,10 @@ static inline void dcpu16_set(dcpu16_t *computer, DCPU16_WORD *where, DCPU16_WOR
 
 		// Set the register value
 		*where = value;
+
+		// SET SP, ADD SP ... move the stack as much as PUSH does
+		if(computer->heatmap && where == &computer->registers[DCPU16_INDEX_REG_SP])
+			heatmap_stack(computer->heatmap, value);
 	}
 }
 
@@ -74,9 +110,17 @@ static inline DCPU16_WORD dcpu16_get(dcpu16_t *computer, DCPU16_WORD *where)
 		// Calculate the RAM address
 		DCPU16_WORD ram_address = where - computer->ram;
 
+		if(computer->heatmap)
+			heatmap_read(computer->heatmap, ram_address);
+
 		// Check for hardware mapped RAM
 		dcpu16_device_t * dev = dcpu16_mapped_device(computer, ram_address);
 		if(dev) {
+			computer->stats.device_reads++;
+
+			if(computer->heatmap)
+				heatmap_device_access(computer->heatmap, computer, dev, 0);
+
 			return dev->read(dev, ram_address - dev->ram_start_address);
 		} else {
 			// Read from RAM
@@ -110,6 +154,9 @@ static inline void dcpu16_decrease_sp(dcpu16_t *computer)
 {
 	computer->registers[DCPU16_INDEX_REG_SP]--;
 
+	if(computer->heatmap)
+		heatmap_stack(computer->heatmap, computer->registers[DCPU16_INDEX_REG_SP]);
+
 	if(computer->callback.register_changed)
 		computer->callback.register_changed(DCPU16_INDEX_REG_SP, computer->registers[DCPU16_INDEX_REG_SP] - 1);
 }
@@ -220,22 +267,52 @@ static void dcpu16_skip_next_instruction(dcpu16_t *computer)
 	dcpu16_pc_callback(computer);
 }
 
+/* Records the fault and calls the illegal instruction callback. */
+static void dcpu16_fault(dcpu16_t *computer, DCPU16_WORD address, DCPU16_WORD instruction, unsigned char fault)
+{
+	computer->fault = fault;
+
+	if(computer->callback.illegal_instruction)
+		computer->callback.illegal_instruction(address, instruction, fault);
+}
+
+/* Records the edge between the previously executed instruction and the one at address in the coverage bitmap. */
+static inline void dcpu16_coverage_step(dcpu16_t *computer, DCPU16_WORD address)
+{
+	// Multiplying by an odd constant scatters neighbouring addresses over the whole bitmap
+	DCPU16_WORD location = address * 0x9E37;
+
+	computer->coverage.bitmap[location ^ computer->coverage.previous_location]++;
+	computer->coverage.previous_location = location >> 1;
+}
+
 /* Executes the next instruction, returns the number of cycles used. */
 unsigned char dcpu16_step(dcpu16_t *computer) 
 {
 	unsigned char cycles = 0;
 
 	// Get the next instruction
-	DCPU16_WORD w = computer->ram[computer->registers[DCPU16_INDEX_REG_PC]];
+	DCPU16_WORD pc = computer->registers[DCPU16_INDEX_REG_PC];
+	DCPU16_WORD w = computer->ram[pc];
+
+	// Decode it
 	char opcode = w & 0xF;
+	char first = (w >> 4) & 0x3F;
+	char second = (w >> 10) & 0x3F;
+
+	if(computer->coverage.bitmap)
+		dcpu16_coverage_step(computer, pc);
+
+	if(computer->heatmap)
+		heatmap_fetch(computer->heatmap, pc);
 
 	computer->registers[DCPU16_INDEX_REG_PC]++;
 
 	// Find out if it is a non basic or basic instruction
 	if(opcode == DCPU16_OPCODE_NON_BASIC) {
 		// Non-basic instruction
-		char o = (w >> 4) & 0x3F;
-		char a = (w >> 10) & 0x3F;
+		char o = first;
+		char a = second;
 
 		// Temporary storage for embedded literal values
 		DCPU16_WORD a_literal_tmp;
@@ -246,12 +323,19 @@ unsigned char dcpu16_step(dcpu16_t *computer)
 
 		switch(o) {
 		case DCPU16_NON_BASIC_OPCODE_RESERVED_0:
-				
+			dcpu16_fault(computer, pc, w, DCPU16_FAULT_RESERVED_0);
+
 			return cycles;
 		case DCPU16_NON_BASIC_OPCODE_JSR_A:
 			dcpu16_decrease_sp(computer);
 			computer->ram[computer->registers[DCPU16_INDEX_REG_SP]] = computer->registers[DCPU16_INDEX_REG_PC];
 
+			if(computer->heatmap)
+				heatmap_write(computer->heatmap, computer->registers[DCPU16_INDEX_REG_SP]);
+
+			if(computer->aot)
+				aot_ram_written(computer->aot, computer->registers[DCPU16_INDEX_REG_SP]);
+
 			computer->registers[DCPU16_INDEX_REG_PC] = dcpu16_get(computer, a_word);	
 
 			return cycles;
@@ -259,8 +343,8 @@ unsigned char dcpu16_step(dcpu16_t *computer)
 
 	} else {
 		// Basic instruction
-		char a = (w >> 4) & 0x3F;
-		char b = (w >> 10) & 0x3F;
+		char a = first;
+		char b = second;
 
 		// Temporary storage for embedded literal values
 		DCPU16_WORD a_literal_tmp, b_literal_tmp;
@@ -274,104 +358,110 @@ unsigned char dcpu16_step(dcpu16_t *computer)
 		// Give up if illegal instruction detected (trying set a literal value)
 		char a_literal = dcpu16_is_literal(a);
 
-		if(a_literal && opcode >= DCPU16_OPCODE_SET && opcode <= DCPU16_OPCODE_XOR) 
+		if(a_literal && opcode >= DCPU16_OPCODE_SET && opcode <= DCPU16_OPCODE_XOR) {
+			dcpu16_fault(computer, pc, w, DCPU16_FAULT_ILLEGAL_WRITE);
 			return 0; // TODO: find out if it is legal to return 0 cycles in this case.
+		}
+
+		// Each operand is read once (SET doesn't read A), so the heatmap and device counters see one access per operand
+		DCPU16_WORD b_value = dcpu16_get(computer, b_word);
+		DCPU16_WORD a_value = opcode == DCPU16_OPCODE_SET ? 0 : dcpu16_get(computer, a_word);
 
 		switch(opcode) {
 		case DCPU16_OPCODE_SET:
 			cycles += 1;
-			dcpu16_set(computer, a_word, dcpu16_get(computer, b_word));
+			dcpu16_set(computer, a_word, b_value);
 
 			break;
 		case DCPU16_OPCODE_ADD:
 			cycles += 2;
 	
-			if((int) dcpu16_get(computer, a_word) + (int) dcpu16_get(computer, b_word) > 0xFFFF) {
+			if((int) a_value + (int) b_value > 0xFFFF) {
 				computer->registers[DCPU16_INDEX_REG_O] = 1;
 			} else {
 				computer->registers[DCPU16_INDEX_REG_O] = 0;
 			}
 
-			dcpu16_set(computer, a_word, dcpu16_get(computer, a_word) + dcpu16_get(computer, b_word));
+			dcpu16_set(computer, a_word, a_value + b_value);
 
 			break;
 		case DCPU16_OPCODE_SUB:
 			cycles += 2;
 
-			if((int) dcpu16_get(computer, a_word) - (int) dcpu16_get(computer, b_word) < 0) {
+			if((int) a_value - (int) b_value < 0) {
 				computer->registers[DCPU16_INDEX_REG_O] = 0xFFFF;
 			} else {
 				computer->registers[DCPU16_INDEX_REG_O] = 0;
 			}
 
-			dcpu16_set(computer, a_word, dcpu16_get(computer, a_word) - dcpu16_get(computer, b_word));
+			dcpu16_set(computer, a_word, a_value - b_value);
 	
 			break;
 		case DCPU16_OPCODE_MUL:
 			cycles += 2;
 
-			computer->registers[DCPU16_INDEX_REG_O] = ((dcpu16_get(computer, a_word) *dcpu16_get(computer, b_word)) >> 16) & 0xFFFF;
-			dcpu16_set(computer, a_word, dcpu16_get(computer, a_word) *dcpu16_get(computer, b_word));
+			computer->registers[DCPU16_INDEX_REG_O] = ((a_value * b_value) >> 16) & 0xFFFF;
+			dcpu16_set(computer, a_word, a_value * b_value);
 
 			break;
 		case DCPU16_OPCODE_DIV:
 			cycles += 3;
 
-			if(dcpu16_get(computer, b_word) == 0) {
+			if(b_value == 0) {
 				computer->registers[DCPU16_INDEX_REG_A] = 0;
 				computer->registers[DCPU16_INDEX_REG_O] = 0;
 			} else {
-				computer->registers[DCPU16_INDEX_REG_O] = ((dcpu16_get(computer, a_word) << 16) / dcpu16_get(computer, b_word)) & 0xFFFF;
-				dcpu16_set(computer, a_word, dcpu16_get(computer, a_word) / dcpu16_get(computer, b_word));
+				computer->registers[DCPU16_INDEX_REG_O] = ((a_value << 16) / b_value) & 0xFFFF;
+				dcpu16_set(computer, a_word, a_value / b_value);
 			}
 
 			break;
 		case DCPU16_OPCODE_MOD:
 			cycles += 3;
 
-			if(dcpu16_get(computer, b_word) == 0) {
+			if(b_value == 0) {
 				computer->registers[DCPU16_INDEX_REG_A] = 0;
 			} else {
-				dcpu16_set(computer, a_word, dcpu16_get(computer, a_word) % dcpu16_get(computer, b_word));
+				dcpu16_set(computer, a_word, a_value % b_value);
 			}
 
 			break;
 		case DCPU16_OPCODE_SHL:
 			cycles += 2;
 
-			computer->registers[DCPU16_INDEX_REG_O] = ((dcpu16_get(computer, a_word) << dcpu16_get(computer, b_word)) >> 16) & 0xFFFF;
-			dcpu16_set(computer, a_word, dcpu16_get(computer, a_word) << dcpu16_get(computer, b_word));
+			computer->registers[DCPU16_INDEX_REG_O] = ((a_value << b_value) >> 16) & 0xFFFF;
+			dcpu16_set(computer, a_word, a_value << b_value);
 
 			break;
 		case DCPU16_OPCODE_SHR:
 			cycles += 2;
 
-			computer->registers[DCPU16_INDEX_REG_O] = ((dcpu16_get(computer, a_word) << 16) >> dcpu16_get(computer, b_word)) & 0xFFFF;
-			dcpu16_set(computer, a_word, dcpu16_get(computer, a_word) >> dcpu16_get(computer, b_word));
+			computer->registers[DCPU16_INDEX_REG_O] = ((a_value << 16) >> b_value) & 0xFFFF;
+			dcpu16_set(computer, a_word, a_value >> b_value);
 
 			break;
 		case DCPU16_OPCODE_AND:
 			cycles += 1;
 
-			dcpu16_set(computer, a_word, dcpu16_get(computer, a_word) & dcpu16_get(computer, b_word));
+			dcpu16_set(computer, a_word, a_value & b_value);
 
 			break;
 		case DCPU16_OPCODE_BOR:
 			cycles += 1;
 
-			dcpu16_set(computer, a_word, dcpu16_get(computer, a_word) | dcpu16_get(computer, b_word));
+			dcpu16_set(computer, a_word, a_value | b_value);
 
 			break;
 		case DCPU16_OPCODE_XOR:
 			cycles += 1;
 
-			dcpu16_set(computer, a_word, dcpu16_get(computer, a_word) ^ dcpu16_get(computer, b_word));
+			dcpu16_set(computer, a_word, a_value ^ b_value);
 
 			break;
 		case DCPU16_OPCODE_IFE:
 			cycles += 2;
 			
-			if(dcpu16_get(computer, a_word) != dcpu16_get(computer, b_word))
+			if(a_value != b_value)
 			{
 				dcpu16_skip_next_instruction(computer);
 				cycles++;
@@ -381,7 +471,7 @@ unsigned char dcpu16_step(dcpu16_t *computer)
 		case DCPU16_OPCODE_IFN:
 			cycles += 2;
 
-			if(dcpu16_get(computer, a_word) == dcpu16_get(computer, b_word))
+			if(a_value == b_value)
 			{
 				dcpu16_skip_next_instruction(computer);
 				cycles++;
@@ -391,7 +481,7 @@ unsigned char dcpu16_step(dcpu16_t *computer)
 		case DCPU16_OPCODE_IFG:
 			cycles += 2;
 
-			if(dcpu16_get(computer, a_word) <= dcpu16_get(computer, b_word))
+			if(a_value <= b_value)
 			{
 				dcpu16_skip_next_instruction(computer);
 				cycles++;
@@ -401,7 +491,7 @@ unsigned char dcpu16_step(dcpu16_t *computer)
 		case DCPU16_OPCODE_IFB:
 			cycles += 2;	
 
-			if(dcpu16_get(computer, a_word) & dcpu16_get(computer, b_word) == 0)
+			if(a_value & b_value == 0)
 			{
 				dcpu16_skip_next_instruction(computer);
 				cycles++;
@@ -465,6 +555,8 @@ void dcpu16_dump_ram(dcpu16_t *computer, DCPU16_WORD start, DCPU16_WORD end)
 void dcpu16_init(dcpu16_t *computer)
 {
 	memset(computer, 0 , sizeof(*computer));
+
+	computer->wakeup_cycle = ~0ULL;
 }
 
 /* Loads a program into the RAM, returns true on success.
@@ -519,6 +611,7 @@ int dcpu16_load_ram(dcpu16_t *computer, const char *file, char binary)
 /* Reads one character using getchar() and does the following depending on the character read:
    r - prints the contents of the registers
    d - ram dump
+   w - write a save state
    Return value is 0 if the read character has been handled by this function, otherwise the character is returned. */
 static char dcpu16_explore_state(dcpu16_t *computer)
 {
@@ -536,6 +629,34 @@ static char dcpu16_explore_state(dcpu16_t *computer)
 		scanf("%hx", &d_end);
 
 		dcpu16_dump_ram(computer, d_start, d_end);
+	} else if(c == 'w') {
+		char state_file[256];
+		char base_file[256];
+
+		PRINTF("\nSave state file: ");
+		scanf("%255s", state_file);
+		PRINTF("Base state file (- for a full state): ");
+		scanf("%255s", base_file);
+
+		int ok;
+		if(strcmp(base_file, "-") == 0) {
+			ok = savestate_save(computer, state_file, 0, 0);
+		} else if(savestate_same_file(state_file, base_file)) {
+			PRINTF("A delta can't replace its own base state\n");
+			ok = 0;
+		} else {
+			// Only the registers and RAM of the base are needed
+			dcpu16_t *base = malloc(sizeof(dcpu16_t));
+			ok = base != 0;
+
+			if(ok) {
+				dcpu16_init(base);
+				ok = savestate_load(base, base_file) && savestate_save(computer, state_file, base, base_file);
+				free(base);
+			}
+		}
+
+		PRINTF(ok ? "State saved\n\n" : "Couldn't save state\n\n");
 	} else {
 		return c;
 	}
@@ -544,14 +665,37 @@ static char dcpu16_explore_state(dcpu16_t *computer)
 }
 
 
+/* Calls the batch function of every device that has one. */
+void dcpu16_batch_devices(dcpu16_t *computer)
+{
+	computer->wakeup_cycle = ~0ULL;
+
+	for(int slot = 0; slot < DCPU16_DEVICE_SLOTS; slot++) {
+		if(computer->devices[slot] && computer->devices[slot]->batch)
+			computer->devices[slot]->batch(computer->devices[slot]);
+	}
+}
+
+/* Resets the devices that support it. */
+static void dcpu16_reset_devices(dcpu16_t *computer)
+{
+	for(int slot = 0; slot < DCPU16_DEVICE_SLOTS; slot++) {
+		if(computer->devices[slot] && computer->devices[slot]->reset)
+			computer->devices[slot]->reset(computer->devices[slot]);
+	}
+}
+
 static void dcpu16_run_debug(dcpu16_t *computer)
 {
 	PRINTF("DCPU16 emulator now running in debug mode\n"
 		"\tType 's' to execute the next instruction\n"
 		"\tType 'r' to print the contents of the registers\n"
 		"\tType 'd' to display what's in the RAM\n"
+		"\tType 'w' to write a save state\n"
 		"\tType 'q' to quit\n\n");
 
+	dcpu16_batch_devices(computer);
+
 	char c = 0;
 	while(c != 'q') {
 		c = dcpu16_explore_state(computer);
@@ -560,10 +704,32 @@ static void dcpu16_run_debug(dcpu16_t *computer)
 			// Step
 			int pc_before = computer->registers[DCPU16_INDEX_REG_PC];
 			int cycles = dcpu16_step(computer);
-			PRINTF("pc: %.4x | instruction: %.4x | cycles: %d | pc afterwards: %.4x\t\n\n",
+			PRINTF("pc: %.4x | instruction: %.4x | cycles: %d | pc afterwards: %.4x\t\n",
 				pc_before, computer->ram[pc_before], cycles, computer->registers[DCPU16_INDEX_REG_PC]);
+
+			// Show where we are in the source
+			DCPU16_WORD offset;
+			const char *label = computer->symbols ? assembler_symbol_at(computer->symbols, pc_before, &offset) : 0;
+			if(label)
+				PRINTF("at: %s+%d\n", label, offset);
+
+			PRINTF("\n");
+
+			computer->stats.instructions++;
+			computer->stats.cycles += cycles;
+
+			if(computer->stats.cycles >= computer->wakeup_cycle)
+				dcpu16_batch_devices(computer);
+
+			if(computer->metrics)
+				metrics_publish(computer->metrics, computer);
 		}
 	}
+
+	computer->stop_reason = DCPU16_STOP_QUIT;
+
+	if(computer->metrics)
+		metrics_publish(computer->metrics, computer);
 }
 
 static void dcpu16_profiler_step(dcpu16_t *computer)
@@ -584,8 +750,16 @@ static void dcpu16_profiler_step(dcpu16_t *computer)
 			// Time since last sample was taken
 			double instructions_per_second = (double)computer->profiling.instruction_count / sample_elapsed;
 			
-			PRINTF("[ PROFILE ]\nSample Duration: %.3lf\nInstructions: %u\nMHz: %.2lf\n-----------\n",
+			PRINTF("[ PROFILE ]\nSample Duration: %.3lf\nInstructions: %u\nMHz: %.2lf\n",
 				   sample_elapsed, computer->profiling.instruction_count, (instructions_per_second / 1000000.0));
+
+			// Where the program happens to be right now
+			DCPU16_WORD offset;
+			const char *label = computer->symbols ? assembler_symbol_at(computer->symbols, computer->registers[DCPU16_INDEX_REG_PC], &offset) : 0;
+			if(label)
+				PRINTF("PC: %.4x (%s+%d)\n", computer->registers[DCPU16_INDEX_REG_PC], label, offset);
+
+			PRINTF("-----------\n");
 			
 			// Reset instruction count
 			computer->profiling.instruction_count = 0;
@@ -596,21 +770,74 @@ static void dcpu16_profiler_step(dcpu16_t *computer)
 	}
 }
 
-void dcpu16_run(dcpu16_t *computer)
+/* Executes up to count instructions and updates the counters. Stops early (setting stop_reason) if the program halts. */
+static void dcpu16_run_batch(dcpu16_t *computer, unsigned count)
 {
-	PRINTF("DCPU16 emulator now running\n");
+	aot_t *aot = computer->aot && aot_prepare(computer->aot, computer) ? computer->aot : 0;
+
+	for(unsigned n = 0; n < count; n++) {
+		// Translated code runs until it reaches an instruction it can't run, which is interpreted below
+		if(aot) {
+			n += aot_run(aot, computer, count - n);
+
+			if(n >= count || computer->stop_reason != DCPU16_STOP_NONE || computer->stats.cycles >= computer->wakeup_cycle)
+				return;
+		}
+
+		DCPU16_WORD pc = computer->registers[DCPU16_INDEX_REG_PC];
+
+		if(computer->blockcache)
+			blockcache_record(computer->blockcache, pc, computer->ram[pc]);
 
-	/* Timo Fixme: This infinite loop detection is quite slow and interferes with performance profiling.  Turned it off for now. */
-	/* while(!(computer->ram[computer->registers[DCPU16_INDEX_REG_PC]] == (((0x20 + computer->registers[DCPU16_INDEX_REG_PC]) << 10) | 1) ||
-	 computer->ram[computer->registers[DCPU16_INDEX_REG_PC]] == 0x7DC1 && 
-	 computer->ram[(DCPU16_WORD)(computer->registers[DCPU16_INDEX_REG_PC] + 1)] == computer->registers[DCPU16_INDEX_REG_PC])) */
-	while(1) {
-		dcpu16_step(computer);
+		computer->stats.cycles += dcpu16_step(computer);
+		computer->stats.instructions++;
+
+		if(computer->fault != DCPU16_FAULT_NONE) {
+			computer->stats.faults++;
+			computer->fault = DCPU16_FAULT_NONE;
+		}
 
 		// Profiling
 		if (computer->profiling.enabled != 0)
 			dcpu16_profiler_step(computer);
+
+		// An instruction that jumps to itself (hang: SET PC, hang) halts the emulator.
+		// Comparing PC before and after is cheap enough to not interfere with profiling.
+		if(computer->registers[DCPU16_INDEX_REG_PC] == pc) {
+			computer->stats.halts++;
+			computer->stop_reason = DCPU16_STOP_HALT;
+			return;
+		}
+
+		// A device asked to be called
+		if(computer->stats.cycles >= computer->wakeup_cycle)
+			return;
 	}
+}
+
+
+/* Runs one batch, calling the devices before it and publishing metrics after it. */
+static void dcpu16_run_once(dcpu16_t *computer)
+{
+	dcpu16_batch_devices(computer);
+	dcpu16_run_batch(computer, DCPU16_BATCH_SIZE);
+
+	// Metrics are only published (and working set sampled) at batch boundaries
+	if(computer->metrics)
+		metrics_publish(computer->metrics, computer);
+
+	if(computer->heatmap)
+		heatmap_sample(computer->heatmap, computer);
+}
+
+void dcpu16_run(dcpu16_t *computer)
+{
+	PRINTF("DCPU16 emulator now running\n");
+
+	computer->stop_reason = DCPU16_STOP_NONE;
+
+	while(computer->stop_reason == DCPU16_STOP_NONE)
+		dcpu16_run_once(computer);
 
 	PRINTF("Emulator halted\n\n");
 
@@ -618,6 +845,7 @@ void dcpu16_run(dcpu16_t *computer)
 	PRINTF("\nYou can now explore the state of the machine\n"
 		"\tType 'r' to print the contents of the registers\n"
 		"\tType 'd' to display what's in the RAM\n"
+		"\tType 'w' to write a save state\n"
 	       	"\tType 'q' to quit\n\n");
 
 	char c = 0;
@@ -626,6 +854,75 @@ void dcpu16_run(dcpu16_t *computer)
 	}
 }
 
+/* Assembles the source and loads it into RAM. Returns true on success. */
+static int dcpu16_assemble(dcpu16_t *computer, assembler_t *assembler)
+{
+	if(!assembler_assemble(assembler)) {
+		PRINTF("%s\n", assembler->error);
+		return 0;
+	}
+
+	assembler_load(assembler, computer);
+	dcpu16_reset_devices(computer);
+	computer->symbols = assembler;
+
+	if(computer->aot)
+		aot_invalidate(computer->aot);
+	computer->stop_reason = DCPU16_STOP_NONE;
+
+	PRINTF("Assembled %u words into RAM (%u of %u lines parsed)\n", assembler->image_size, assembler->lines_parsed, assembler->line_count);
+
+	return 1;
+}
+
+// Set by SIGINT while watching the source
+static volatile sig_atomic_t dcpu16_interrupted = 0;
+
+static void dcpu16_interrupt(int signal_number)
+{
+	dcpu16_interrupted = 1;
+}
+
+/* Runs the program and reassembles and restarts it whenever the source changes. Returns on SIGINT (Ctrl-C)
+   or once the source has been deleted. */
+static void dcpu16_run_watch(dcpu16_t *computer, assembler_t *assembler)
+{
+	PRINTF("DCPU16 emulator now running, restarting when %s changes (Ctrl-C to quit)\n", assembler->file);
+
+	dcpu16_interrupted = 0;
+	signal(SIGINT, dcpu16_interrupt);
+
+	while(!dcpu16_interrupted) {
+		// The file is only checked every few batches to keep the stat calls cheap
+		for(int n = 0; computer->stop_reason == DCPU16_STOP_NONE; n++) {
+			dcpu16_run_once(computer);
+
+			if(dcpu16_interrupted)
+				computer->stop_reason = DCPU16_STOP_QUIT;
+			else if(n % 16 == 0 && assembler_source_changed(assembler))
+				break;
+		}
+
+		if(computer->stop_reason == DCPU16_STOP_HALT) {
+			PRINTF("Emulator halted\n");
+			dcpu16_print_registers(computer);
+		}
+
+		// Wait for an edit that assembles
+		int changed;
+		do {
+			changed = assembler_wait_for_change(assembler, &dcpu16_interrupted);
+		} while(changed && !dcpu16_assemble(computer, assembler));
+
+		if(!changed)
+			break;
+	}
+
+	signal(SIGINT, SIG_DFL);
+
+	PRINTF("Stopped watching %s\n", assembler->file);
+}
+
 int main(int argc, char *argv[]) 
 {
 	dcpu16_t computerOnTheStack;
@@ -637,6 +934,23 @@ int main(int argc, char *argv[])
 	char binary_ram_file 	= 0;
 	char debug_mode 	= 0;
 	char enable_profiling 	= 0;
+	char fuzz_mode		= 0;
+	DCPU16_WORD fuzz_input_address = FUZZ_DEFAULT_INPUT_ADDRESS;
+	unsigned long long fuzz_iterations = 0;
+	char *metrics_name	= 0;
+	char *state_file	= 0;
+	char *cache_directory	= 0;
+	char *heatmap_file	= 0;
+	char watch_source	= 0;
+	char *aot_file		= 0;
+	char *assembled_file	= 0;
+	char *frame_stream_file	= 0;
+	char *frame_ppm_pattern	= 0;
+	unsigned frame_rate	= FRAMEBUFFER_DEFAULT_FPS;
+	char *key_script_file	= 0;
+	char *disk_files[DISK_MAX_DRIVES];
+	char disk_writable[DISK_MAX_DRIVES];
+	unsigned disk_count	= 0;
 	
 	// Parse the arguments
 	for(int c = 1; c < argc; c++) {
@@ -646,13 +960,132 @@ int main(int argc, char *argv[])
 			binary_ram_file = 1;
 		} else if(strcmp(argv[c], "-p") == 0) {
 			enable_profiling = 1;
+		} else if(strcmp(argv[c], "-w") == 0) {
+			watch_source = 1;
+		} else if(strcmp(argv[c], "-f") == 0) {
+			fuzz_mode = 1;
+		} else if(strcmp(argv[c], "-fa") == 0 && c + 1 < argc) {
+			fuzz_input_address = strtoul(argv[++c], 0, 16);
+		} else if(strcmp(argv[c], "-fn") == 0 && c + 1 < argc) {
+			fuzz_iterations = strtoull(argv[++c], 0, 10);
+		} else if(strcmp(argv[c], "-S") == 0 && c + 1 < argc) {
+			state_file = argv[++c];
+		} else if(strcmp(argv[c], "-c") == 0 && c + 1 < argc) {
+			cache_directory = argv[++c];
+		} else if(strcmp(argv[c], "-hm") == 0 && c + 1 < argc) {
+			heatmap_file = argv[++c];
+		} else if(strcmp(argv[c], "-o") == 0 && c + 1 < argc) {
+			frame_stream_file = argv[++c];
+		} else if(strcmp(argv[c], "-op") == 0 && c + 1 < argc) {
+			frame_ppm_pattern = argv[++c];
+		} else if(strcmp(argv[c], "-fps") == 0 && c + 1 < argc) {
+			frame_rate = strtoul(argv[++c], 0, 10);
+		} else if(strcmp(argv[c], "-k") == 0 && c + 1 < argc) {
+			key_script_file = argv[++c];
+		} else if((strcmp(argv[c], "-D") == 0 || strcmp(argv[c], "-Dw") == 0) && c + 1 < argc) {
+			if(disk_count == DISK_MAX_DRIVES) {
+				PRINTF("Too many disks (at most %d).\n", DISK_MAX_DRIVES);
+				return 0;
+			}
+
+			disk_writable[disk_count] = argv[c][2] == 'w';
+			disk_files[disk_count++] = argv[++c];
+		} else if(strcmp(argv[c], "-a") == 0 && c + 1 < argc) {
+			assembled_file = argv[++c];
+		} else if(strcmp(argv[c], "-aot") == 0 && c + 1 < argc) {
+			aot_file = argv[++c];
+		} else if(strcmp(argv[c], "-m") == 0 && c + 1 < argc) {
+			metrics_name = argv[++c];
+		} else if(strcmp(argv[c], "-mp") == 0 && c + 1 < argc) {
+			if(!metrics_print(argv[++c]))
+				PRINTF("Couldn't open metrics segment %s.\n", argv[c]);
+			return 0;
 		} else {
 			ram_file = argv[c];
 		}
 	}
 
-	// Load RAM file
-	if(ram_file) {
+	// Headless screen rendering (installed before loading so save states can restore the screen)
+	dcpu16_device_t screen_device;
+	framebuffer_t *framebuffer = 0;
+	if(frame_stream_file || frame_ppm_pattern) {
+		FILE *frame_stream = 0;
+
+		if(frame_ppm_pattern && !framebuffer_check_pattern(frame_ppm_pattern)) {
+			PRINTF("Bad frame file pattern %s (it needs exactly one integer conversion, e.g. frame%%05llu.ppm).\n", frame_ppm_pattern);
+			return 0;
+		}
+
+		if(frame_stream_file && !(frame_stream = fopen(frame_stream_file, "wb"))) {
+			PRINTF("Couldn't open frame stream %s.\n", frame_stream_file);
+			return 0;
+		}
+
+		framebuffer = malloc(sizeof(framebuffer_t));
+		screen_t *screen = screen_create_device(&screen_device);
+		if(!framebuffer || !screen) {
+			PRINTF("Couldn't allocate memory for the screen.\n");
+			return 0;
+		}
+
+		framebuffer_init(framebuffer, frame_rate, frame_stream, frame_ppm_pattern);
+		screen->framebuffer = framebuffer;
+		dcpu16_install_device(computer, &screen_device);
+	}
+
+	// Keyboard fed from a script (installed before loading for the same reason)
+	dcpu16_device_t keyboard_device;
+	keyboard_t *keyboard = 0;
+	if(key_script_file) {
+		keyboard = keyboard_create_device(&keyboard_device);
+		if(!keyboard) {
+			PRINTF("Couldn't allocate memory for the keyboard.\n");
+			return 0;
+		}
+
+		if(!keyboard_replay(keyboard, key_script_file)) {
+			PRINTF("Couldn't replay key script %s.\n", key_script_file);
+			return 0;
+		}
+
+		dcpu16_install_device(computer, &keyboard_device);
+	}
+
+	// Disks, read-only images are shared and copied on write
+	dcpu16_device_t disk_devices[DISK_MAX_DRIVES];
+	for(unsigned drive = 0; drive < disk_count; drive++) {
+		disk_t *disk = disk_create_device(&disk_devices[drive], drive);
+		if(!disk) {
+			PRINTF("Couldn't allocate memory for the disk.\n");
+			return 0;
+		}
+
+		if(!disk_open(disk, disk_files[drive], disk_writable[drive])) {
+			PRINTF("Couldn't open disk image %s (missing or smaller than a sector).\n", disk_files[drive]);
+			return 0;
+		}
+
+		dcpu16_install_device(computer, &disk_devices[drive]);
+	}
+
+	// Load RAM file (or save state, or assemble the source)
+	assembler_t *assembler = 0;
+	if(state_file) {
+		if(!savestate_load(computer, state_file)) {
+			PRINTF("Couldn't load save state (bad file or missing base state).\n");
+			return 0;
+		}
+	} else if(ram_file && assembler_is_source_file(ram_file)) {
+		assembler = malloc(sizeof(assembler_t));
+		if(!assembler) {
+			PRINTF("Couldn't allocate memory for the assembler.\n");
+			return 0;
+		}
+
+		assembler_init(assembler, ram_file);
+		if(!dcpu16_assemble(computer, assembler))
+			return 0;
+	} else if(ram_file) {
 		if(!dcpu16_load_ram(computer, ram_file, binary_ram_file)) {
 			PRINTF("Couldn't load RAM file (too large or bad file).\n");
 			return 0;
@@ -662,6 +1095,63 @@ int main(int argc, char *argv[])
 		return 0;
 	}
 
+	// Write the assembled program and exit
+	if(assembled_file) {
+		if(!assembler)
+			PRINTF("Only assembly sources can be written with -a.\n");
+		else if(!assembler_write(assembler, assembled_file))
+			PRINTF("Couldn't write %s\n", assembled_file);
+
+		return 0;
+	}
+
+	// Block cache, recorded by the first run of an image and only read (by -aot) once it exists
+	blockcache_t *blockcache = 0;
+	char cache_file[4096];
+	if(cache_directory) {
+		blockcache = malloc(sizeof(blockcache_t));
+		if(!blockcache) {
+			PRINTF("Couldn't allocate memory for the block cache.\n");
+			return 0;
+		}
+
+		blockcache_init(blockcache, computer);
+		blockcache_file_name(blockcache, cache_directory, cache_file, sizeof(cache_file));
+
+		// Recording needs every instruction interpreted, don't pay for it (or lose the translated code) again
+		if(blockcache_load(blockcache, cache_file)) {
+			blockcache_release(blockcache, computer);
+			PRINTF("Loaded block cache %s\n", cache_file);
+		}
+	}
+
+	// Translate the program into C and exit
+	if(aot_file) {
+		DCPU16_WORD entry = computer->registers[DCPU16_INDEX_REG_PC];
+		unsigned instructions = aot_translate(computer, entry, blockcache, aot_file);
+
+		if(instructions)
+			PRINTF("Translated %u instructions reachable from %.4x into %s\n", instructions, entry, aot_file);
+		else
+			PRINTF("Couldn't write %s\n", aot_file);
+
+		return 0;
+	}
+
+#ifdef DCPU16_AOT
+	// Translated code built into this emulator (make aot), only used for the image it was translated from
+	aot_t *aot = malloc(sizeof(aot_t));
+	if(!aot) {
+		PRINTF("Couldn't allocate memory for the translated code.\n");
+		return 0;
+	}
+
+	if(aot_init(aot, computer, &aot_image))
+		PRINTF("Running %u translated instructions\n", aot_image.instruction_count);
+	else
+		PRINTF("The translated code is for another program, interpreting\n");
+#endif
+
 	// Profiling
 	if(enable_profiling) {
 		// Enable profiling
@@ -671,11 +1161,102 @@ int main(int argc, char *argv[])
 		computer->profiling.sample_frequency = 1.0;
 	}
 
+	// RAM heatmap
+	heatmap_t *heatmap = 0;
+	if(heatmap_file) {
+		heatmap = malloc(sizeof(heatmap_t));
+		if(!heatmap) {
+			PRINTF("Couldn't allocate memory for the heatmap.\n");
+			return 0;
+		}
+
+		heatmap_init(heatmap, computer);
+	}
+
+	// Live metrics
+	metrics_t metrics;
+	if(metrics_name) {
+		if(!metrics_open(&metrics, metrics_name, METRICS_DEFAULT_SLOTS)) {
+			PRINTF("Couldn't open metrics segment %s.\n", metrics_name);
+			return 0;
+		}
+
+		computer->metrics = &metrics;
+	}
+
+	// Fuzzing
+	if(fuzz_mode) {
+		fuzz_t *fuzz = malloc(sizeof(fuzz_t));
+		if(!fuzz) {
+			PRINTF("Couldn't allocate memory for fuzzing.\n");
+			return 0;
+		}
+
+		if(!fuzz_init(fuzz, computer, fuzz_input_address, FUZZ_DEFAULT_MAX_INPUT_WORDS, FUZZ_DEFAULT_MAX_INSTRUCTIONS)) {
+			PRINTF("Can't fuzz with a device that doesn't have save states installed.\n");
+			return 0;
+		}
+
+		fuzz_loop(fuzz, fuzz_iterations);
+		fuzz_release(fuzz);
+		free(fuzz);
+
+		return 0;
+	}
+
 	// Start the emulator
-	if(debug_mode)
+	if(watch_source && assembler)
+		dcpu16_run_watch(computer, assembler);
+	else if(debug_mode)
 		dcpu16_run_debug(computer);
 	else
 		dcpu16_run(computer);
+
+	if(computer->metrics)
+		metrics_close(computer->metrics);
+
+	if(assembler) {
+		computer->symbols = 0;
+		assembler_release(assembler);
+		free(assembler);
+	}
+
+	if(framebuffer) {
+		framebuffer_flush(framebuffer, screen_device.struct_ptr, computer);
+
+		if(framebuffer->stream)
+			fclose(framebuffer->stream);
+
+		screen_release_device(&screen_device);
+		free(framebuffer);
+	}
+
+	if(keyboard)
+		keyboard_release_device(&keyboard_device);
+
+	for(unsigned drive = 0; drive < disk_count; drive++)
+		disk_release_device(&disk_devices[drive]);
+
+	if(heatmap) {
+		if(!heatmap_export(heatmap, computer, heatmap_file))
+			PRINTF("Couldn't write heatmap %s\n", heatmap_file);
+
+		heatmap_release(heatmap, computer);
+		free(heatmap);
+	}
+
+#ifdef DCPU16_AOT
+	computer->aot = 0;
+	free(aot);
+#endif
+
+	if(blockcache) {
+		if(computer->blockcache == blockcache && !blockcache_save(blockcache, cache_file))
+			PRINTF("Couldn't save block cache %s\n", cache_file);
+
+		blockcache_release(blockcache, computer);
+		free(blockcache);
+	}
 	
 	return 0;
 }
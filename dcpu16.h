@@ -75,8 +75,24 @@ typedef unsigned short DCPU16_WORD;
 
 #define DCPU16_DEVICE_SLOTS				256
 
+#define DCPU16_COVERAGE_MAP_SIZE			0x10000
+
+#define DCPU16_BATCH_SIZE				10000
+#define DCPU16_CLOCK_HZ				100000
+
+#define DCPU16_STOP_NONE				0
+#define DCPU16_STOP_HALT				1
+#define DCPU16_STOP_QUIT				2
+
+#define DCPU16_FAULT_NONE				0
+#define DCPU16_FAULT_ILLEGAL_WRITE			1
+#define DCPU16_FAULT_RESERVED_0			2
+
 typedef struct _dcpu16_device_t
 {
+	// The computer the device is installed in (set by dcpu16_install_device)
+	struct _dcpu16_t * computer;
+
 	// RAM mapped for I/O
 	DCPU16_WORD ram_start_address;
 	DCPU16_WORD ram_end_address;
@@ -85,6 +101,19 @@ typedef struct _dcpu16_device_t
 	void (* write)(struct _dcpu16_device_t * dev, DCPU16_WORD relative_address, DCPU16_WORD value);
 	DCPU16_WORD (* read)(struct _dcpu16_device_t * dev, DCPU16_WORD relative_address);
 
+	// Optional, used by save states. state_size returns how many bytes save_state writes,
+	// load_state returns true if the state could be restored.
+	unsigned (* state_size)(struct _dcpu16_device_t * dev);
+	void (* save_state)(struct _dcpu16_device_t * dev, unsigned char * buffer);
+	int (* load_state)(struct _dcpu16_device_t * dev, const unsigned char * buffer, unsigned size);
+
+	// Optional, called by dcpu16_run before every batch of instructions. Use dcpu16_request_wakeup
+	// to end the batch once the device needs to be called again.
+	void (* batch)(struct _dcpu16_device_t * dev);
+
+	// Optional, puts the device back in its power on state when a program is restarted (-w)
+	void (* reset)(struct _dcpu16_device_t * dev);
+
 	// Pointer to device specific structure
 	void * struct_ptr;
 
@@ -101,10 +130,51 @@ typedef struct _dcpu16_t
 		unsigned instruction_count;
 	} profiling;
 
+	// Used for coverage-guided fuzzing (edge coverage is only recorded when bitmap is set)
+	struct coverage {
+		unsigned char * bitmap;
+		DCPU16_WORD previous_location;
+	} coverage;
+
+	// Set by dcpu16_step when an instruction can't be executed (DCPU16_FAULT_*)
+	unsigned char fault;
+
+	// Counters, updated by dcpu16_run and the RAM access functions
+	struct stats {
+		unsigned long long instructions;
+		unsigned long long cycles;
+		unsigned long long device_reads;
+		unsigned long long device_writes;
+		unsigned long long faults;
+		unsigned long long halts;
+	} stats;
+
+	// Why dcpu16_run stopped (DCPU16_STOP_*)
+	unsigned char stop_reason;
+
+	// dcpu16_run ends the current batch once stats.cycles reaches this value
+	unsigned long long wakeup_cycle;
+
+	// Used for publishing live metrics (see metrics.h), 0 if disabled
+	struct _metrics_t * metrics;
+
+	// Decoded instructions and block statistics (see blockcache.h), 0 if disabled
+	struct _blockcache_t * blockcache;
+
+	// RAM access counters and working set samples (see heatmap.h), 0 if disabled
+	struct _heatmap_t * heatmap;
+
+	// Ahead-of-time translated code (see aot.h), 0 if the program is interpreted
+	struct _aot_t * aot;
+
+	// Labels of the assembled program (see assembler.h), 0 if the program wasn't assembled
+	const struct _assembler_t * symbols;
+
 	// Pointers to callback functions
 	struct callback {
 		void (* register_changed)(unsigned char reg, DCPU16_WORD val);
 		void (* unmapped_ram_changed)(DCPU16_WORD address, DCPU16_WORD val);
+		void (* illegal_instruction)(DCPU16_WORD address, DCPU16_WORD instruction, unsigned char fault);
 	} callback;
 	
 	// RAM mapped devices
@@ -119,6 +189,9 @@ typedef struct _dcpu16_t
 /* Declaration of "public" functions */
 int dcpu16_install_device(dcpu16_t *computer, dcpu16_device_t *device);
 void dcpu16_uninstall_device(dcpu16_t *computer, int slot);
+void dcpu16_request_wakeup(dcpu16_t *computer, unsigned long long cycle);
+void dcpu16_batch_devices(dcpu16_t *computer);
+dcpu16_device_t * dcpu16_mapped_device(dcpu16_t *computer, DCPU16_WORD address);
 void dcpu16_init(dcpu16_t *computer);
 int dcpu16_load_ram(dcpu16_t *computer, const char *file, char binary);
 void dcpu16_run(dcpu16_t *computer);
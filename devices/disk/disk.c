@@ -0,0 +1,467 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "disk.h"
+#include "heatmap.h"
+#include "aot.h"
+
+typedef struct _disk_worker_t
+{
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+
+	disk_t * disk;
+
+	// Set by the CPU thread when there's a transfer to do, cleared by the worker once it's done
+	int pending;
+
+	// Set to make the thread exit
+	int stop;
+} disk_worker_t;
+
+/* Copies the sectors of the transfer between the image and the transfer buffer. */
+static void disk_copy(disk_t * disk)
+{
+	unsigned words = disk->count * DISK_SECTOR_SIZE;
+	unsigned char * p = disk->image + (unsigned long long)disk->sector * DISK_SECTOR_SIZE * 2;
+
+	if(disk->command == DISK_COMMAND_READ) {
+		for(unsigned n = 0; n < words; n++, p += 2)
+			disk->transfer[n] = p[0] | (p[1] << 8);
+	} else {
+		for(unsigned n = 0; n < words; n++, p += 2) {
+			p[0] = disk->transfer[n] & 0xFF;
+			p[1] = disk->transfer[n] >> 8;
+		}
+	}
+}
+
+static void * disk_worker_thread(void * arg)
+{
+	disk_worker_t * worker = arg;
+
+	pthread_mutex_lock(&worker->lock);
+
+	for(;;) {
+		while(!worker->pending && !worker->stop)
+			pthread_cond_wait(&worker->changed, &worker->lock);
+
+		if(!worker->pending)
+			break;
+
+		// Touching the image may have to page it in, don't hold the lock meanwhile
+		pthread_mutex_unlock(&worker->lock);
+		disk_copy(worker->disk);
+		pthread_mutex_lock(&worker->lock);
+
+		worker->pending = 0;
+		pthread_cond_broadcast(&worker->changed);
+	}
+
+	pthread_mutex_unlock(&worker->lock);
+
+	return 0;
+}
+
+/* Waits until the worker is done with the transfer in progress, if any. */
+static void disk_wait(disk_t * disk)
+{
+	if(!disk->worker)
+		return;
+
+	pthread_mutex_lock(&disk->worker->lock);
+	while(disk->worker->pending)
+		pthread_cond_wait(&disk->worker->changed, &disk->worker->lock);
+	pthread_mutex_unlock(&disk->worker->lock);
+}
+
+/* Hands the transfer to the worker. */
+static void disk_kick(disk_t * disk)
+{
+	pthread_mutex_lock(&disk->worker->lock);
+	disk->worker->pending = 1;
+	pthread_cond_broadcast(&disk->worker->changed);
+	pthread_mutex_unlock(&disk->worker->lock);
+}
+
+/* Starts the command written to the COMMAND register. */
+static void disk_start(dcpu16_device_t * dev, disk_t * disk, DCPU16_WORD command)
+{
+	dcpu16_t * computer = dev->computer;
+	DCPU16_WORD sector = disk->registers[DISK_REG_SECTOR];
+	DCPU16_WORD count = disk->registers[DISK_REG_COUNT];
+
+	if(!disk->worker || (command != DISK_COMMAND_READ && command != DISK_COMMAND_WRITE) ||
+	   !count || count > DISK_MAX_TRANSFER || (unsigned)sector + count > disk->registers[DISK_REG_SECTORS]) {
+		disk->registers[DISK_REG_STATUS] = DISK_STATUS_ERROR;
+		return;
+	}
+
+	disk->command = command;
+	disk->sector = sector;
+	disk->address = disk->registers[DISK_REG_ADDRESS];
+	disk->count = count;
+
+	// The program may change RAM while the transfer runs, the disk gets what was there when the command was written
+	if(command == DISK_COMMAND_WRITE) {
+		for(unsigned n = 0; n < count * DISK_SECTOR_SIZE; n++)
+			disk->transfer[n] = computer->ram[(DCPU16_WORD)(disk->address + n)];
+
+		for(unsigned s = sector; s < (unsigned)sector + count; s++)
+			disk->written[s >> 3] |= 1 << (s & 7);
+	}
+
+	disk->done_cycle = computer->stats.cycles + DISK_SEEK_CYCLES + count * DISK_SECTOR_CYCLES;
+	disk->registers[DISK_REG_STATUS] = DISK_STATUS_BUSY;
+
+	disk_kick(disk);
+
+	dcpu16_request_wakeup(computer, disk->done_cycle);
+}
+
+/* Ends the transfer in progress once the program has run long enough, waiting for the worker if it's late. */
+static void disk_batch(dcpu16_device_t * dev)
+{
+	disk_t * disk = dev->struct_ptr;
+	dcpu16_t * computer = dev->computer;
+
+	if(disk->registers[DISK_REG_STATUS] != DISK_STATUS_BUSY)
+		return;
+
+	if(computer->stats.cycles < disk->done_cycle) {
+		dcpu16_request_wakeup(computer, disk->done_cycle);
+		return;
+	}
+
+	disk_wait(disk);
+
+	if(disk->command == DISK_COMMAND_READ) {
+		for(unsigned n = 0; n < disk->count * DISK_SECTOR_SIZE; n++) {
+			DCPU16_WORD address = disk->address + n;
+
+			if(computer->callback.unmapped_ram_changed)
+				computer->callback.unmapped_ram_changed(address, disk->transfer[n]);
+
+			computer->ram[address] = disk->transfer[n];
+
+			if(computer->heatmap)
+				heatmap_write(computer->heatmap, address);
+
+			if(computer->aot)
+				aot_ram_written(computer->aot, address);
+		}
+	}
+
+	disk->registers[DISK_REG_STATUS] = DISK_STATUS_READY;
+}
+
+/* Drops the transfer in progress (the worker is waited for, RAM is not written) and clears the registers. */
+static void disk_reset(dcpu16_device_t * dev)
+{
+	disk_t * disk = dev->struct_ptr;
+	DCPU16_WORD sectors = disk->registers[DISK_REG_SECTORS];
+
+	disk_wait(disk);
+
+	memset(disk->registers, 0, sizeof(disk->registers));
+	disk->registers[DISK_REG_SECTORS] = sectors;
+}
+
+static void disk_write(dcpu16_device_t * dev, DCPU16_WORD address, DCPU16_WORD value)
+{
+	disk_t * disk = dev->struct_ptr;
+
+	if(address == DISK_REG_STATUS || address == DISK_REG_SECTORS)
+		return;
+
+	if(address == DISK_REG_COMMAND && disk->registers[DISK_REG_STATUS] == DISK_STATUS_BUSY)
+		return;
+
+	disk->registers[address] = value;
+
+	if(address == DISK_REG_COMMAND)
+		disk_start(dev, disk, value);
+}
+
+static DCPU16_WORD disk_read(dcpu16_device_t * dev, DCPU16_WORD address)
+{
+	disk_t * disk = dev->struct_ptr;
+
+	return disk->registers[address];
+}
+
+// Save state layout, followed by a disk_state_sector_t for every written sector of a read-only disk
+typedef struct _disk_state_t
+{
+	DCPU16_WORD registers[DISK_REGISTER_COUNT];
+
+	// Transfer in progress (when STATUS is busy)
+	DCPU16_WORD command;
+	DCPU16_WORD sector;
+	DCPU16_WORD address;
+	DCPU16_WORD count;
+	uint64_t done_cycle;
+
+	// Image hash (read-only disks), 0 for writable disks
+	uint64_t image_hash;
+	uint32_t writable;
+	uint32_t sector_count;
+} disk_state_t;
+
+typedef struct _disk_state_sector_t
+{
+	uint32_t sector;
+	unsigned char data[DISK_SECTOR_SIZE * 2];
+} disk_state_sector_t;
+
+/* FNV-1a (64-bit) of the image file. Read-only disks never change the file, so this is the image as opened. */
+static uint64_t disk_image_hash(disk_t * disk)
+{
+	if(disk->image_hashed)
+		return disk->image_hash;
+
+	unsigned char buffer[DISK_SECTOR_SIZE * 2 * 64];
+	uint64_t hash = 14695981039346656037ull;
+
+	for(unsigned long long offset = 0; offset < disk->image_size; offset += sizeof(buffer)) {
+		ssize_t size = pread(disk->fd, buffer, sizeof(buffer), offset);
+		if(size <= 0)
+			break;
+
+		for(ssize_t i = 0; i < size; i++)
+			hash = (hash ^ buffer[i]) * 1099511628211ull;
+	}
+
+	disk->image_hash = hash;
+	disk->image_hashed = 1;
+
+	return hash;
+}
+
+/* Returns the number of sectors a save state of the disk stores. */
+static unsigned disk_state_sectors(const disk_t * disk)
+{
+	unsigned count = 0;
+
+	for(unsigned s = 0; !disk->writable && s < disk->registers[DISK_REG_SECTORS]; s++)
+		count += (disk->written[s >> 3] >> (s & 7)) & 1;
+
+	return count;
+}
+
+static unsigned disk_state_size(dcpu16_device_t * dev)
+{
+	return sizeof(disk_state_t) + disk_state_sectors(dev->struct_ptr) * sizeof(disk_state_sector_t);
+}
+
+static void disk_save_state(dcpu16_device_t * dev, unsigned char * buffer)
+{
+	disk_t * disk = dev->struct_ptr;
+	disk_state_t state;
+
+	// A write in progress has to reach the image first
+	disk_wait(disk);
+
+	memset(&state, 0, sizeof(state));
+	memcpy(state.registers, disk->registers, sizeof(state.registers));
+	state.command = disk->command;
+	state.sector = disk->sector;
+	state.address = disk->address;
+	state.count = disk->count;
+	state.done_cycle = disk->done_cycle;
+	state.image_hash = disk->writable ? 0 : disk_image_hash(disk);
+	state.writable = disk->writable;
+	state.sector_count = disk_state_sectors(disk);
+	memcpy(buffer, &state, sizeof(state));
+
+	disk_state_sector_t * record = (disk_state_sector_t *)(buffer + sizeof(state));
+	for(unsigned s = 0; state.sector_count && s < disk->registers[DISK_REG_SECTORS]; s++) {
+		if(disk->written[s >> 3] & (1 << (s & 7))) {
+			record->sector = s;
+			memcpy(record->data, disk->image + (unsigned long long)s * sizeof(record->data), sizeof(record->data));
+			record++;
+		}
+	}
+}
+
+static int disk_load_state(dcpu16_device_t * dev, const unsigned char * buffer, unsigned size)
+{
+	disk_t * disk = dev->struct_ptr;
+	disk_state_t state;
+
+	if(!disk->worker || size < sizeof(state))
+		return 0;
+
+	memcpy(&state, buffer, sizeof(state));
+
+	// Check everything before touching the disk
+	DCPU16_WORD sectors = disk->registers[DISK_REG_SECTORS];
+	DCPU16_WORD status = state.registers[DISK_REG_STATUS];
+
+	if(state.writable != (uint32_t)disk->writable || state.registers[DISK_REG_SECTORS] != sectors ||
+	   (!disk->writable && state.image_hash != disk_image_hash(disk)) ||
+	   (disk->writable && state.sector_count) ||
+	   size != sizeof(state) + (unsigned long long)state.sector_count * sizeof(disk_state_sector_t))
+		return 0;
+
+	if(status != DISK_STATUS_READY && status != DISK_STATUS_BUSY && status != DISK_STATUS_ERROR)
+		return 0;
+
+	if(status == DISK_STATUS_BUSY && ((state.command != DISK_COMMAND_READ && state.command != DISK_COMMAND_WRITE) ||
+	   !state.count || state.count > DISK_MAX_TRANSFER || (unsigned)state.sector + state.count > sectors))
+		return 0;
+
+	const disk_state_sector_t * records = (const disk_state_sector_t *)(buffer + sizeof(state));
+	unsigned char written[sizeof(disk->written)];
+	memset(written, 0, sizeof(written));
+
+	for(uint32_t r = 0; r < state.sector_count; r++) {
+		uint32_t s;
+		memcpy(&s, &records[r].sector, sizeof(s));
+
+		if(s >= sectors)
+			return 0;
+
+		written[s >> 3] |= 1 << (s & 7);
+	}
+
+	disk_wait(disk);
+
+	// Sectors written since the state was taken go back to the image, the others get their saved contents
+	for(unsigned s = 0; !disk->writable && s < sectors; s++) {
+		unsigned long long offset = (unsigned long long)s * DISK_SECTOR_SIZE * 2;
+
+		if((disk->written[s >> 3] & (1 << (s & 7))) && !(written[s >> 3] & (1 << (s & 7))) &&
+		   pread(disk->fd, disk->image + offset, DISK_SECTOR_SIZE * 2, offset) != DISK_SECTOR_SIZE * 2)
+			memset(disk->image + offset, 0, DISK_SECTOR_SIZE * 2);
+	}
+
+	for(uint32_t r = 0; r < state.sector_count; r++) {
+		uint32_t s;
+		memcpy(&s, &records[r].sector, sizeof(s));
+		memcpy(disk->image + (unsigned long long)s * DISK_SECTOR_SIZE * 2, records[r].data, DISK_SECTOR_SIZE * 2);
+	}
+
+	if(!disk->writable)
+		memcpy(disk->written, written, sizeof(written));
+
+	memcpy(disk->registers, state.registers, sizeof(disk->registers));
+	disk->command = state.command;
+	disk->sector = state.sector;
+	disk->address = state.address;
+	disk->count = state.count;
+	disk->done_cycle = state.done_cycle;
+
+	// The sectors of a read in progress are read again, a write in progress already reached the image
+	if(status == DISK_STATUS_BUSY && state.command == DISK_COMMAND_READ)
+		disk_kick(disk);
+
+	return 1;
+}
+
+/* Maps the image and starts the worker. Read-only images are mapped copy on write. Returns true on success. */
+int disk_open(disk_t * disk, const char * file, int writable)
+{
+	int fd = open(file, writable ? O_RDWR : O_RDONLY);
+	if(fd < 0)
+		return 0;
+
+	struct stat st;
+	unsigned long long sectors = 0;
+	if(fstat(fd, &st) == 0)
+		sectors = st.st_size / (DISK_SECTOR_SIZE * 2);
+
+	// Sectors past the last one SECTOR can address are left out
+	if(sectors > DISK_MAX_SECTORS)
+		sectors = DISK_MAX_SECTORS;
+
+	unsigned long long size = sectors * DISK_SECTOR_SIZE * 2;
+	void * image = size ? mmap(0, size, PROT_READ | PROT_WRITE, writable ? MAP_SHARED : MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	if(image == MAP_FAILED) {
+		close(fd);
+		return 0;
+	}
+
+	disk_worker_t * worker = calloc(1, sizeof(disk_worker_t));
+	if(!worker) {
+		munmap(image, size);
+		close(fd);
+		return 0;
+	}
+
+	worker->disk = disk;
+	pthread_mutex_init(&worker->lock, 0);
+	pthread_cond_init(&worker->changed, 0);
+
+	if(pthread_create(&worker->thread, 0, disk_worker_thread, worker) != 0) {
+		pthread_cond_destroy(&worker->changed);
+		pthread_mutex_destroy(&worker->lock);
+		free(worker);
+		munmap(image, size);
+		close(fd);
+		return 0;
+	}
+
+	disk->image = image;
+	disk->image_size = size;
+	disk->fd = fd;
+	disk->writable = writable;
+	disk->worker = worker;
+	disk->registers[DISK_REG_SECTORS] = sectors;
+
+	return 1;
+}
+
+disk_t * disk_create_device(dcpu16_device_t * dev, unsigned drive)
+{
+	memset(dev, 0, sizeof(*dev));
+
+	dev->ram_start_address = DISK_RAM_START_ADDRESS + drive * DISK_REGISTER_COUNT;
+	dev->ram_end_address = DISK_RAM_END_ADDRESS(drive);
+
+	dev->write = disk_write;
+	dev->read = disk_read;
+	dev->batch = disk_batch;
+	dev->reset = disk_reset;
+
+	dev->state_size = disk_state_size;
+	dev->save_state = disk_save_state;
+	dev->load_state = disk_load_state;
+
+	dev->struct_ptr = calloc(1, sizeof(disk_t));
+
+	return dev->struct_ptr;
+}
+
+void disk_release_device(dcpu16_device_t * dev)
+{
+	disk_t * disk = dev->struct_ptr;
+
+	if(disk && disk->worker) {
+		// The worker finishes a transfer in progress first
+		pthread_mutex_lock(&disk->worker->lock);
+		disk->worker->stop = 1;
+		pthread_cond_broadcast(&disk->worker->changed);
+		pthread_mutex_unlock(&disk->worker->lock);
+
+		pthread_join(disk->worker->thread, 0);
+		pthread_cond_destroy(&disk->worker->changed);
+		pthread_mutex_destroy(&disk->worker->lock);
+		free(disk->worker);
+
+		if(disk->writable)
+			msync(disk->image, disk->image_size, MS_SYNC);
+
+		munmap(disk->image, disk->image_size);
+		close(disk->fd);
+	}
+
+	free(dev->struct_ptr);
+	dev->struct_ptr = 0;
+}
@@ -0,0 +1,90 @@
+#ifndef DISK_H
+#define DISK_H
+
+#include <stdint.h>
+#include "dcpu16.h"
+
+/* A block storage device backed by a host image file. The image is a sequence of sectors of
+   DISK_SECTOR_SIZE little endian words (the same format as binary RAM files).
+
+   The image is memory mapped. Disks opened read-only map it privately: sectors the program writes
+   are copied on write into memory of this instance only and the file is never changed, so any number
+   of disks (in one or many emulators) can share the same base image. Writable disks write back to the file.
+
+   A program sets SECTOR, ADDRESS and COUNT and then writes a command to COMMAND. STATUS reads
+   DISK_STATUS_BUSY until the transfer is done, commands written while the disk is busy are ignored.
+   The sectors are copied on a worker thread while the program runs. The transfer takes
+   DISK_SEEK_CYCLES + COUNT * DISK_SECTOR_CYCLES cycles and completes (RAM is written, STATUS changes)
+   at the first instruction boundary after that, so programs see the same timing on every run.
+   Transfers go straight to RAM, bypassing mapped devices.
+
+   Save states hold the registers and the transfer in progress. Read-only disks also store the sectors
+   the program wrote (they only exist in memory) and the hash of their image, and refuse to restore on a
+   different image. Writable disks keep their sectors in the image file, only its size is checked. */
+
+#define DISK_SECTOR_SIZE		512
+#define DISK_MAX_SECTORS		0xFFFF
+
+// Sectors one transfer can move at most (all of RAM)
+#define DISK_MAX_TRANSFER		(DCPU16_RAM_SIZE / DISK_SECTOR_SIZE)
+
+#define DISK_SEEK_CYCLES		1000
+#define DISK_SECTOR_CYCLES		256
+
+// Drives are mapped one after the other, right after the keyboard
+#define DISK_MAX_DRIVES			4
+#define DISK_REGISTER_COUNT		8
+#define DISK_RAM_START_ADDRESS		0x9010
+#define DISK_RAM_END_ADDRESS(drive)	(DISK_RAM_START_ADDRESS + ((drive) + 1) * DISK_REGISTER_COUNT - 1)
+
+// Registers (relative addresses)
+#define DISK_REG_COMMAND		0
+#define DISK_REG_SECTOR			1
+#define DISK_REG_ADDRESS		2
+#define DISK_REG_COUNT			3
+#define DISK_REG_STATUS			4	// Read only
+#define DISK_REG_SECTORS		5	// Read only, size of the disk
+
+#define DISK_COMMAND_READ		1	// Disk to RAM
+#define DISK_COMMAND_WRITE		2	// RAM to disk
+
+#define DISK_STATUS_READY		0
+#define DISK_STATUS_BUSY		1
+#define DISK_STATUS_ERROR		2	// Unknown command or sectors out of range
+
+typedef struct _disk_t
+{
+	DCPU16_WORD registers[DISK_REGISTER_COUNT];
+
+	// The mapped image
+	unsigned char * image;
+	unsigned long long image_size;
+	int fd;
+	int writable;
+
+	// Transfer in progress, copied from the registers when the command was written
+	DCPU16_WORD command;
+	DCPU16_WORD sector;
+	DCPU16_WORD address;
+	DCPU16_WORD count;
+	unsigned long long done_cycle;
+
+	// Sectors of the transfer in progress, only touched by the worker until it's done
+	DCPU16_WORD transfer[DCPU16_RAM_SIZE];
+
+	// Bitmap of the sectors written by the program (see the save state functions)
+	unsigned char written[(DISK_MAX_SECTORS + 8) / 8];
+
+	// Hash of the image file as opened, computed the first time a save state needs it
+	uint64_t image_hash;
+	int image_hashed;
+
+	// Thread copying the sectors, 0 if no image is open
+	struct _disk_worker_t * worker;
+} disk_t;
+
+disk_t * disk_create_device(dcpu16_device_t * dev, unsigned drive);
+void disk_release_device(dcpu16_device_t * dev);
+int disk_open(disk_t * disk, const char * file, int writable);
+
+#endif
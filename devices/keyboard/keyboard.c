@@ -0,0 +1,254 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "keyboard.h"
+
+typedef struct _keyboard_replay_t
+{
+	pthread_t thread;
+	keyboard_t * keyboard;
+
+	DCPU16_WORD * keys;
+	unsigned key_count;
+
+	// Set to make the thread give up
+	int stop;
+
+	// Set by the thread once it has pushed every key (or gave up)
+	int done;
+} keyboard_replay_t;
+
+/* Pushes up to count keys, returns how many were pushed (fewer if the queue is full). Safe to call from any thread. */
+unsigned keyboard_push(keyboard_t * keyboard, const DCPU16_WORD * keys, unsigned count)
+{
+	keyboard_queue_t * queue = &keyboard->queue;
+	unsigned position = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+	unsigned reserved;
+
+	// Reserve all the slots at once
+	do {
+		unsigned head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+		unsigned free_slots = KEYBOARD_QUEUE_SIZE - (position - head);
+
+		reserved = count < free_slots ? count : free_slots;
+		if(!reserved)
+			return 0;
+	} while(!__atomic_compare_exchange_n(&queue->tail, &position, position + reserved, 1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+	// Fill them, each slot is published on its own so the keyboard can read the first ones already
+	for(unsigned n = 0; n < reserved; n++) {
+		unsigned slot = (position + n) & (KEYBOARD_QUEUE_SIZE - 1);
+
+		queue->keys[slot] = keys[n];
+		__atomic_store_n(&queue->sequence[slot], position + n + 1, __ATOMIC_RELEASE);
+	}
+
+	return reserved;
+}
+
+/* Moves keys from the queue into the free words of the ring buffer. */
+static void keyboard_drain(keyboard_t * keyboard)
+{
+	keyboard_queue_t * queue = &keyboard->queue;
+	unsigned position = queue->head;
+
+	while(!keyboard->buffer[keyboard->write_index]) {
+		unsigned slot = position & (KEYBOARD_QUEUE_SIZE - 1);
+
+		if(__atomic_load_n(&queue->sequence[slot], __ATOMIC_ACQUIRE) != position + 1)
+			break;
+
+		keyboard->buffer[keyboard->write_index] = queue->keys[slot];
+		keyboard->write_index = (keyboard->write_index + 1) % KEYBOARD_BUFFER_SIZE;
+		position++;
+	}
+
+	// Hands the slots back to the producers
+	if(position != queue->head)
+		__atomic_store_n(&queue->head, position, __ATOMIC_RELEASE);
+}
+
+static void * keyboard_replay_thread(void * arg)
+{
+	keyboard_replay_t * replay = arg;
+	unsigned pushed = 0;
+
+	while(pushed < replay->key_count && !__atomic_load_n(&replay->stop, __ATOMIC_RELAXED)) {
+		unsigned count = replay->key_count - pushed;
+		if(count > KEYBOARD_REPLAY_CHUNK)
+			count = KEYBOARD_REPLAY_CHUNK;
+
+		unsigned n = keyboard_push(replay->keyboard, replay->keys + pushed, count);
+		pushed += n;
+
+		// Queue full, wait for the program to read some keys
+		if(n < count) {
+			struct timespec delay = { 0, 1000000 };
+			nanosleep(&delay, 0);
+		}
+	}
+
+	__atomic_store_n(&replay->done, 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/* Starts a thread that pushes every byte of the file as a key, except NUL bytes (0 marks a free word).
+   Returns true on success. */
+int keyboard_replay(keyboard_t * keyboard, const char * file)
+{
+	FILE *f = fopen(file, "rb");
+	if(!f)
+		return 0;
+
+	keyboard_replay_t * replay = calloc(1, sizeof(keyboard_replay_t));
+	unsigned capacity = 0;
+	int c;
+
+	while(replay && (c = fgetc(f)) != EOF) {
+		if(!c)
+			continue;
+
+		if(replay->key_count == capacity) {
+			capacity = capacity ? capacity * 2 : 1024;
+
+			DCPU16_WORD * keys = realloc(replay->keys, capacity * sizeof(DCPU16_WORD));
+			if(!keys)
+				break;
+
+			replay->keys = keys;
+		}
+
+		replay->keys[replay->key_count++] = (unsigned char)c;
+	}
+
+	fclose(f);
+
+	if(!replay || c != EOF) {
+		if(replay)
+			free(replay->keys);
+		free(replay);
+		return 0;
+	}
+
+	replay->keyboard = keyboard;
+
+	if(pthread_create(&replay->thread, 0, keyboard_replay_thread, replay) != 0) {
+		free(replay->keys);
+		free(replay);
+		return 0;
+	}
+
+	keyboard->replay = replay;
+
+	return 1;
+}
+
+static void keyboard_write(dcpu16_device_t * dev, DCPU16_WORD address, DCPU16_WORD value)
+{
+	keyboard_t * keyboard = dev->struct_ptr;
+
+	keyboard->buffer[address] = value;
+}
+
+static DCPU16_WORD keyboard_read(dcpu16_device_t * dev, DCPU16_WORD address)
+{
+	keyboard_t * keyboard = dev->struct_ptr;
+
+	return keyboard->buffer[address];
+}
+
+/* Returns true if keys are waiting in the queue or the replay is still pushing some. */
+static int keyboard_pending(keyboard_t * keyboard)
+{
+	if(__atomic_load_n(&keyboard->queue.tail, __ATOMIC_ACQUIRE) != keyboard->queue.head)
+		return 1;
+
+	return keyboard->replay && !__atomic_load_n(&keyboard->replay->done, __ATOMIC_ACQUIRE);
+}
+
+static void keyboard_batch(dcpu16_device_t * dev)
+{
+	keyboard_t * keyboard = dev->struct_ptr;
+
+	keyboard_drain(keyboard);
+
+	// Debug mode only calls the devices when one asked for it, keep asking until every key is delivered
+	if(keyboard_pending(keyboard))
+		dcpu16_request_wakeup(dev->computer, dev->computer->stats.cycles + KEYBOARD_POLL_CYCLES);
+}
+
+static unsigned keyboard_state_size(dcpu16_device_t * dev)
+{
+	return sizeof(((keyboard_t *)0)->buffer) + 1;
+}
+
+static void keyboard_save_state(dcpu16_device_t * dev, unsigned char * buffer)
+{
+	keyboard_t * keyboard = dev->struct_ptr;
+
+	memcpy(buffer, keyboard->buffer, sizeof(keyboard->buffer));
+	buffer[sizeof(keyboard->buffer)] = keyboard->write_index;
+}
+
+static int keyboard_load_state(dcpu16_device_t * dev, const unsigned char * buffer, unsigned size)
+{
+	keyboard_t * keyboard = dev->struct_ptr;
+
+	if(size != sizeof(keyboard->buffer) + 1 || buffer[sizeof(keyboard->buffer)] >= KEYBOARD_BUFFER_SIZE)
+		return 0;
+
+	memcpy(keyboard->buffer, buffer, sizeof(keyboard->buffer));
+	keyboard->write_index = buffer[sizeof(keyboard->buffer)];
+
+	return 1;
+}
+
+/* Empties the ring buffer. Keys still in the queue are delivered to the restarted program. */
+static void keyboard_reset(dcpu16_device_t * dev)
+{
+	keyboard_t * keyboard = dev->struct_ptr;
+
+	memset(keyboard->buffer, 0, sizeof(keyboard->buffer));
+	keyboard->write_index = 0;
+}
+
+keyboard_t * keyboard_create_device(dcpu16_device_t * dev)
+{
+	memset(dev, 0, sizeof(*dev));
+
+	dev->ram_start_address = KEYBOARD_RAM_START_ADDRESS;
+	dev->ram_end_address = KEYBOARD_RAM_END_ADDRESS;
+
+	dev->write = keyboard_write;
+	dev->read = keyboard_read;
+	dev->batch = keyboard_batch;
+	dev->reset = keyboard_reset;
+
+	dev->state_size = keyboard_state_size;
+	dev->save_state = keyboard_save_state;
+	dev->load_state = keyboard_load_state;
+
+	dev->struct_ptr = calloc(1, sizeof(keyboard_t));
+
+	return dev->struct_ptr;
+}
+
+void keyboard_release_device(dcpu16_device_t * dev)
+{
+	keyboard_t * keyboard = dev->struct_ptr;
+
+	if(keyboard && keyboard->replay) {
+		__atomic_store_n(&keyboard->replay->stop, 1, __ATOMIC_RELAXED);
+		pthread_join(keyboard->replay->thread, 0);
+
+		free(keyboard->replay->keys);
+		free(keyboard->replay);
+	}
+
+	free(dev->struct_ptr);
+	dev->struct_ptr = 0;
+}
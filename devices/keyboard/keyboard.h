@@ -0,0 +1,58 @@
+#ifndef KEYBOARD_H
+#define KEYBOARD_H
+
+#include "dcpu16.h"
+
+/* The keyboard maps a ring buffer of KEYBOARD_BUFFER_SIZE words. Keys are written to the buffer in
+   order, starting over at the first word after the last one. A program reads the words in the same
+   order and writes 0 to a word once it has read the key, the keyboard only writes to words that are 0.
+
+   Keys come from the host through a lock-free queue any number of threads can push to at once
+   (keyboard_push). The queue is drained into the ring buffer once per batch, in the device batch
+   function, so the CPU thread never waits on the producers. The key 0 can't be typed, it marks a free word. */
+
+#define KEYBOARD_BUFFER_SIZE			16
+
+#define KEYBOARD_RAM_START_ADDRESS		0x9000
+#define KEYBOARD_RAM_END_ADDRESS		(KEYBOARD_RAM_START_ADDRESS + KEYBOARD_BUFFER_SIZE - 1)
+
+// Must be a power of two
+#define KEYBOARD_QUEUE_SIZE			4096
+
+// Keys the replay thread pushes at a time
+#define KEYBOARD_REPLAY_CHUNK			256
+
+// While keys are on their way the keyboard asks to be called again after this many cycles
+#define KEYBOARD_POLL_CYCLES			1000
+
+typedef struct _keyboard_queue_t
+{
+	DCPU16_WORD keys[KEYBOARD_QUEUE_SIZE];
+
+	// Position + 1 of the key in the slot once it can be read
+	unsigned sequence[KEYBOARD_QUEUE_SIZE];
+
+	// Next position producers reserve and next position the keyboard reads (positions wrap around)
+	unsigned tail;
+	unsigned head;
+} keyboard_queue_t;
+
+typedef struct _keyboard_t
+{
+	DCPU16_WORD buffer[KEYBOARD_BUFFER_SIZE];
+
+	// Word the next key is written to
+	unsigned char write_index;
+
+	keyboard_queue_t queue;
+
+	// Thread pushing the keys of a script (see keyboard_replay), 0 if none
+	struct _keyboard_replay_t * replay;
+} keyboard_t;
+
+keyboard_t * keyboard_create_device(dcpu16_device_t * dev);
+void keyboard_release_device(dcpu16_device_t * dev);
+unsigned keyboard_push(keyboard_t * keyboard, const DCPU16_WORD * keys, unsigned count);
+int keyboard_replay(keyboard_t * keyboard, const char * file);
+
+#endif
@@ -0,0 +1,282 @@
+#include <string.h>
+#include "framebuffer.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* 16 colour palette (bit 0 blue, bit 1 green, bit 2 red, bit 3 bright). */
+static const uint32_t framebuffer_palette[16] = {
+	0x000000, 0x0000AA, 0x00AA00, 0x00AAAA, 0xAA0000, 0xAA00AA, 0xAA5500, 0xAAAAAA,
+	0x555555, 0x5555FF, 0x55FF55, 0x55FFFF, 0xFF5555, 0xFF55FF, 0xFFFF55, 0xFFFFFF
+};
+
+/* Font ROM, one 4 bit row per byte (bit 3 is the leftmost pixel), top row first. */
+static const unsigned char framebuffer_font[128][FRAMEBUFFER_GLYPH_HEIGHT] = {
+	{ 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0 }, { 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0 },	// 0x00 0x01
+	{ 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0 }, { 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0 },	// 0x02 0x03
+	{ 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0 }, { 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0 },	// 0x04 0x05
+	{ 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0 }, { 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0 },	// 0x06 0x07
+	{ 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0 }, { 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0 },	// 0x08 0x09
+	{ 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0 }, { 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0 },	// 0x0a 0x0b
+	{ 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0 }, { 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0 },	// 0x0c 0x0d
+	{ 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0 }, { 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0 },	// 0x0e 0x0f
+	{ 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0 }, { 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0 },	// 0x10 0x11
+	{ 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0 }, { 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0 },	// 0x12 0x13
+	{ 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0 }, { 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0 },	// 0x14 0x15
+	{ 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0 }, { 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0 },	// 0x16 0x17
+	{ 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0 }, { 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0 },	// 0x18 0x19
+	{ 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0 }, { 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0 },	// 0x1a 0x1b
+	{ 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0 }, { 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0 },	// 0x1c 0x1d
+	{ 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0 }, { 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0 },	// 0x1e 0x1f
+	{ 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0 }, { 0x4, 0x4, 0x4, 0x4, 0x4, 0x0, 0x4, 0x0 },	// ' ' '!'
+	{ 0xa, 0xa, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0 }, { 0xa, 0xe, 0xa, 0xa, 0xe, 0xa, 0x0, 0x0 },	// '"' '#'
+	{ 0x4, 0xe, 0x8, 0xe, 0x2, 0xe, 0x4, 0x0 }, { 0xa, 0x2, 0x4, 0x4, 0x8, 0xa, 0x0, 0x0 },	// '$' '%'
+	{ 0x4, 0xa, 0x4, 0xc, 0xa, 0x6, 0x0, 0x0 }, { 0x4, 0x4, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0 },	// '&' "'"
+	{ 0x2, 0x4, 0x8, 0x8, 0x8, 0x4, 0x2, 0x0 }, { 0x8, 0x4, 0x2, 0x2, 0x2, 0x4, 0x8, 0x0 },	// '(' ')'
+	{ 0x0, 0xa, 0x4, 0xe, 0x4, 0xa, 0x0, 0x0 }, { 0x0, 0x4, 0x4, 0xe, 0x4, 0x4, 0x0, 0x0 },	// '*' '+'
+	{ 0x0, 0x0, 0x0, 0x0, 0x0, 0x4, 0x4, 0x8 }, { 0x0, 0x0, 0x0, 0xe, 0x0, 0x0, 0x0, 0x0 },	// ',' '-'
+	{ 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x4, 0x0 }, { 0x2, 0x2, 0x4, 0x4, 0x8, 0x8, 0x0, 0x0 },	// '.' '/'
+	{ 0xe, 0xa, 0xa, 0xa, 0xa, 0xe, 0x0, 0x0 }, { 0x4, 0xc, 0x4, 0x4, 0x4, 0xe, 0x0, 0x0 },	// '0' '1'
+	{ 0xe, 0x2, 0xe, 0x8, 0x8, 0xe, 0x0, 0x0 }, { 0xe, 0x2, 0x6, 0x2, 0x2, 0xe, 0x0, 0x0 },	// '2' '3'
+	{ 0xa, 0xa, 0xe, 0x2, 0x2, 0x2, 0x0, 0x0 }, { 0xe, 0x8, 0xe, 0x2, 0x2, 0xe, 0x0, 0x0 },	// '4' '5'
+	{ 0xe, 0x8, 0xe, 0xa, 0xa, 0xe, 0x0, 0x0 }, { 0xe, 0x2, 0x2, 0x4, 0x4, 0x4, 0x0, 0x0 },	// '6' '7'
+	{ 0xe, 0xa, 0xe, 0xa, 0xa, 0xe, 0x0, 0x0 }, { 0xe, 0xa, 0xe, 0x2, 0x2, 0xe, 0x0, 0x0 },	// '8' '9'
+	{ 0x0, 0x4, 0x0, 0x0, 0x4, 0x0, 0x0, 0x0 }, { 0x0, 0x4, 0x0, 0x0, 0x4, 0x4, 0x8, 0x0 },	// ':' ';'
+	{ 0x2, 0x4, 0x8, 0x8, 0x4, 0x2, 0x0, 0x0 }, { 0x0, 0x0, 0xe, 0x0, 0xe, 0x0, 0x0, 0x0 },	// '<' '='
+	{ 0x8, 0x4, 0x2, 0x2, 0x4, 0x8, 0x0, 0x0 }, { 0xe, 0x2, 0x6, 0x4, 0x0, 0x4, 0x0, 0x0 },	// '>' '?'
+	{ 0xe, 0xa, 0xe, 0xe, 0x8, 0xe, 0x0, 0x0 }, { 0x4, 0xa, 0xa, 0xe, 0xa, 0xa, 0x0, 0x0 },	// '@' 'A'
+	{ 0xc, 0xa, 0xc, 0xa, 0xa, 0xc, 0x0, 0x0 }, { 0x6, 0x8, 0x8, 0x8, 0x8, 0x6, 0x0, 0x0 },	// 'B' 'C'
+	{ 0xc, 0xa, 0xa, 0xa, 0xa, 0xc, 0x0, 0x0 }, { 0xe, 0x8, 0xc, 0x8, 0x8, 0xe, 0x0, 0x0 },	// 'D' 'E'
+	{ 0xe, 0x8, 0xc, 0x8, 0x8, 0x8, 0x0, 0x0 }, { 0x6, 0x8, 0x8, 0xa, 0xa, 0x6, 0x0, 0x0 },	// 'F' 'G'
+	{ 0xa, 0xa, 0xe, 0xa, 0xa, 0xa, 0x0, 0x0 }, { 0xe, 0x4, 0x4, 0x4, 0x4, 0xe, 0x0, 0x0 },	// 'H' 'I'
+	{ 0x2, 0x2, 0x2, 0x2, 0xa, 0x4, 0x0, 0x0 }, { 0xa, 0xa, 0xc, 0xa, 0xa, 0xa, 0x0, 0x0 },	// 'J' 'K'
+	{ 0x8, 0x8, 0x8, 0x8, 0x8, 0xe, 0x0, 0x0 }, { 0xa, 0xe, 0xe, 0xa, 0xa, 0xa, 0x0, 0x0 },	// 'L' 'M'
+	{ 0xc, 0xa, 0xa, 0xa, 0xa, 0xa, 0x0, 0x0 }, { 0x4, 0xa, 0xa, 0xa, 0xa, 0x4, 0x0, 0x0 },	// 'N' 'O'
+	{ 0xc, 0xa, 0xc, 0x8, 0x8, 0x8, 0x0, 0x0 }, { 0x4, 0xa, 0xa, 0xa, 0xc, 0x6, 0x0, 0x0 },	// 'P' 'Q'
+	{ 0xc, 0xa, 0xc, 0xa, 0xa, 0xa, 0x0, 0x0 }, { 0x6, 0x8, 0x4, 0x2, 0x2, 0xc, 0x0, 0x0 },	// 'R' 'S'
+	{ 0xe, 0x4, 0x4, 0x4, 0x4, 0x4, 0x0, 0x0 }, { 0xa, 0xa, 0xa, 0xa, 0xa, 0xe, 0x0, 0x0 },	// 'T' 'U'
+	{ 0xa, 0xa, 0xa, 0xa, 0xa, 0x4, 0x0, 0x0 }, { 0xa, 0xa, 0xa, 0xe, 0xe, 0xa, 0x0, 0x0 },	// 'V' 'W'
+	{ 0xa, 0xa, 0x4, 0xa, 0xa, 0xa, 0x0, 0x0 }, { 0xa, 0xa, 0x4, 0x4, 0x4, 0x4, 0x0, 0x0 },	// 'X' 'Y'
+	{ 0xe, 0x2, 0x4, 0x8, 0x8, 0xe, 0x0, 0x0 }, { 0xc, 0x8, 0x8, 0x8, 0x8, 0x8, 0xc, 0x0 },	// 'Z' '['
+	{ 0x8, 0x8, 0x4, 0x4, 0x2, 0x2, 0x0, 0x0 }, { 0x6, 0x2, 0x2, 0x2, 0x2, 0x2, 0x6, 0x0 },	// '\\' ']'
+	{ 0x4, 0xa, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0 }, { 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0xe },	// '^' '_'
+	{ 0x8, 0x4, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0 }, { 0x0, 0x0, 0x6, 0xa, 0xa, 0x6, 0x0, 0x0 },	// '`' 'a'
+	{ 0x8, 0x8, 0xc, 0xa, 0xa, 0xc, 0x0, 0x0 }, { 0x0, 0x0, 0x6, 0x8, 0x8, 0x6, 0x0, 0x0 },	// 'b' 'c'
+	{ 0x2, 0x2, 0x6, 0xa, 0xa, 0x6, 0x0, 0x0 }, { 0x0, 0x0, 0x4, 0xe, 0x8, 0x6, 0x0, 0x0 },	// 'd' 'e'
+	{ 0x2, 0x4, 0xe, 0x4, 0x4, 0x4, 0x0, 0x0 }, { 0x0, 0x0, 0x6, 0xa, 0x6, 0x2, 0xc, 0x0 },	// 'f' 'g'
+	{ 0x8, 0x8, 0xc, 0xa, 0xa, 0xa, 0x0, 0x0 }, { 0x4, 0x0, 0xc, 0x4, 0x4, 0xe, 0x0, 0x0 },	// 'h' 'i'
+	{ 0x2, 0x0, 0x2, 0x2, 0x2, 0xa, 0x4, 0x0 }, { 0x8, 0x8, 0xa, 0xc, 0xa, 0xa, 0x0, 0x0 },	// 'j' 'k'
+	{ 0xc, 0x4, 0x4, 0x4, 0x4, 0xe, 0x0, 0x0 }, { 0x0, 0x0, 0xa, 0xe, 0xa, 0xa, 0x0, 0x0 },	// 'l' 'm'
+	{ 0x0, 0x0, 0xc, 0xa, 0xa, 0xa, 0x0, 0x0 }, { 0x0, 0x0, 0x4, 0xa, 0xa, 0x4, 0x0, 0x0 },	// 'n' 'o'
+	{ 0x0, 0x0, 0xc, 0xa, 0xc, 0x8, 0x8, 0x0 }, { 0x0, 0x0, 0x6, 0xa, 0x6, 0x2, 0x2, 0x0 },	// 'p' 'q'
+	{ 0x0, 0x0, 0xa, 0xc, 0x8, 0x8, 0x0, 0x0 }, { 0x0, 0x0, 0x6, 0xc, 0x2, 0xc, 0x0, 0x0 },	// 'r' 's'
+	{ 0x4, 0x4, 0xe, 0x4, 0x4, 0x2, 0x0, 0x0 }, { 0x0, 0x0, 0xa, 0xa, 0xa, 0x6, 0x0, 0x0 },	// 't' 'u'
+	{ 0x0, 0x0, 0xa, 0xa, 0xa, 0x4, 0x0, 0x0 }, { 0x0, 0x0, 0xa, 0xa, 0xe, 0xa, 0x0, 0x0 },	// 'v' 'w'
+	{ 0x0, 0x0, 0xa, 0x4, 0x4, 0xa, 0x0, 0x0 }, { 0x0, 0x0, 0xa, 0xa, 0x6, 0x2, 0xc, 0x0 },	// 'x' 'y'
+	{ 0x0, 0x0, 0xe, 0x4, 0x8, 0xe, 0x0, 0x0 }, { 0x2, 0x4, 0x4, 0x8, 0x4, 0x4, 0x2, 0x0 },	// 'z' '{'
+	{ 0x4, 0x4, 0x4, 0x4, 0x4, 0x4, 0x4, 0x0 }, { 0x8, 0x4, 0x4, 0x2, 0x4, 0x4, 0x8, 0x0 },	// '|' '}'
+	{ 0x0, 0x0, 0x6, 0xc, 0x0, 0x0, 0x0, 0x0 }, { 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf },	// '~' 0x7f
+};
+
+/* Pixel masks for every possible glyph row. */
+#define FRAMEBUFFER_MASK(bit)		((bit) ? 0xFFFFFFFFu : 0)
+#define FRAMEBUFFER_ROW_MASK(row)	{ FRAMEBUFFER_MASK((row) & 8), FRAMEBUFFER_MASK((row) & 4), FRAMEBUFFER_MASK((row) & 2), FRAMEBUFFER_MASK((row) & 1) }
+
+static const uint32_t framebuffer_row_masks[16][FRAMEBUFFER_GLYPH_WIDTH] = {
+	FRAMEBUFFER_ROW_MASK(0x0), FRAMEBUFFER_ROW_MASK(0x1), FRAMEBUFFER_ROW_MASK(0x2), FRAMEBUFFER_ROW_MASK(0x3),
+	FRAMEBUFFER_ROW_MASK(0x4), FRAMEBUFFER_ROW_MASK(0x5), FRAMEBUFFER_ROW_MASK(0x6), FRAMEBUFFER_ROW_MASK(0x7),
+	FRAMEBUFFER_ROW_MASK(0x8), FRAMEBUFFER_ROW_MASK(0x9), FRAMEBUFFER_ROW_MASK(0xA), FRAMEBUFFER_ROW_MASK(0xB),
+	FRAMEBUFFER_ROW_MASK(0xC), FRAMEBUFFER_ROW_MASK(0xD), FRAMEBUFFER_ROW_MASK(0xE), FRAMEBUFFER_ROW_MASK(0xF)
+};
+
+/* Checks that a PPM file pattern has exactly one integer conversion (%u, %05llu ...) and no other conversions
+   except %%. Returns 0 if it doesn't, 1 if the conversion takes an int and 2 if it takes a long long. */
+int framebuffer_check_pattern(const char *pattern)
+{
+	int result = 0;
+
+	for(const char *p = pattern; *p; p++) {
+		if(*p != '%')
+			continue;
+
+		if(*++p == '%')
+			continue;
+
+		// Flags, width and precision
+		p += strspn(p, "-+ #0");
+		p += strspn(p, "0123456789");
+		if(*p == '.') {
+			p++;
+			p += strspn(p, "0123456789");
+		}
+
+		int size = 1;
+		if(p[0] == 'l' && p[1] == 'l') {
+			size = 2;
+			p += 2;
+		}
+
+		if(result || !*p || !strchr("diouxX", *p))
+			return 0;
+
+		result = size;
+	}
+
+	return result;
+}
+
+/* Sets up the renderer. stream and ppm_pattern (a printf pattern taking the frame number, e.g. "frame%05llu.ppm") may be 0. */
+void framebuffer_init(framebuffer_t *fb, unsigned fps, FILE *stream, const char *ppm_pattern)
+{
+	memset(fb, 0, sizeof(*fb));
+
+	fb->fps = fps ? fps : FRAMEBUFFER_DEFAULT_FPS;
+	fb->full_redraw = 1;
+	fb->stream = stream;
+	fb->ppm_pattern = ppm_pattern && framebuffer_check_pattern(ppm_pattern) ? ppm_pattern : 0;
+	fb->ppm_long_long = fb->ppm_pattern && framebuffer_check_pattern(ppm_pattern) == 2;
+}
+
+/* Draws one cell. A row of a glyph is 4 pixels, which is exactly one 128-bit store. */
+static inline void framebuffer_draw_cell(framebuffer_t *fb, unsigned column, unsigned row, DCPU16_WORD cell, int blink_visible)
+{
+	const unsigned char *glyph = framebuffer_font[SCREEN_CELL_CHARACTER(cell)];
+	uint32_t fg = framebuffer_palette[SCREEN_CELL_FOREGROUND(cell)];
+	uint32_t bg = framebuffer_palette[SCREEN_CELL_BACKGROUND(cell)];
+	uint32_t *dst = &fb->pixels[row * FRAMEBUFFER_GLYPH_HEIGHT * FRAMEBUFFER_WIDTH + column * FRAMEBUFFER_GLYPH_WIDTH];
+
+	// Blinking cells show only the background while hidden
+	if(SCREEN_CELL_BLINK(cell) && !blink_visible)
+		glyph = framebuffer_font[' '];
+
+#ifdef __SSE2__
+	__m128i fg4 = _mm_set1_epi32(fg);
+	__m128i bg4 = _mm_set1_epi32(bg);
+
+	for(int y = 0; y < FRAMEBUFFER_GLYPH_HEIGHT; y++, dst += FRAMEBUFFER_WIDTH) {
+		__m128i mask = _mm_loadu_si128((const __m128i *)framebuffer_row_masks[glyph[y]]);
+		_mm_storeu_si128((__m128i *)dst, _mm_or_si128(_mm_and_si128(mask, fg4), _mm_andnot_si128(mask, bg4)));
+	}
+#else
+	for(int y = 0; y < FRAMEBUFFER_GLYPH_HEIGHT; y++, dst += FRAMEBUFFER_WIDTH) {
+		const uint32_t *mask = framebuffer_row_masks[glyph[y]];
+
+		for(int x = 0; x < FRAMEBUFFER_GLYPH_WIDTH; x++)
+			dst[x] = (mask[x] & fg) | (~mask[x] & bg);
+	}
+#endif
+}
+
+/* Redraws the cells that were written since the last call, and the blinking cells if the blink phase changed. */
+void framebuffer_render(framebuffer_t *fb, screen_t *screen, int blink_visible)
+{
+	int blink_changed = blink_visible != fb->blink_visible;
+
+	for(unsigned i = 0; i < SCREEN_COLUMNS * SCREEN_ROWS; i++) {
+		DCPU16_WORD cell = screen->screen_buffer[i];
+
+		if(fb->full_redraw || screen->dirty[i] || (blink_changed && SCREEN_CELL_BLINK(cell))) {
+			framebuffer_draw_cell(fb, i % SCREEN_COLUMNS, i / SCREEN_COLUMNS, cell, blink_visible);
+			screen->dirty[i] = 0;
+		}
+	}
+
+	fb->blink_visible = blink_visible;
+	fb->full_redraw = 0;
+}
+
+/* Converts the framebuffer to RGB24. */
+static void framebuffer_to_rgb(const framebuffer_t *fb, unsigned char *rgb)
+{
+	for(unsigned i = 0; i < FRAMEBUFFER_WIDTH * FRAMEBUFFER_HEIGHT; i++, rgb += 3) {
+		rgb[0] = fb->pixels[i] >> 16;
+		rgb[1] = fb->pixels[i] >> 8;
+		rgb[2] = fb->pixels[i];
+	}
+}
+
+/* Appends the frame to a raw RGB24 stream. Returns true on success. */
+int framebuffer_write_frame(const framebuffer_t *fb, FILE *f)
+{
+	unsigned char rgb[FRAMEBUFFER_WIDTH * FRAMEBUFFER_HEIGHT * 3];
+	framebuffer_to_rgb(fb, rgb);
+
+	return fwrite(rgb, sizeof(rgb), 1, f) == 1;
+}
+
+/* Writes the frame as a binary PPM image. Returns true on success. */
+int framebuffer_write_ppm(const framebuffer_t *fb, const char *file)
+{
+	FILE *f = fopen(file, "wb");
+	if(!f)
+		return 0;
+
+	fprintf(f, "P6\n%d %d\n255\n", FRAMEBUFFER_WIDTH, FRAMEBUFFER_HEIGHT);
+	int ok = framebuffer_write_frame(fb, f);
+
+	if(fclose(f) != 0)
+		ok = 0;
+
+	return ok;
+}
+
+/* Draws the next frame and writes it to the outputs. */
+static void framebuffer_emit(framebuffer_t *fb, screen_t *screen, int blink_visible)
+{
+	framebuffer_render(fb, screen, blink_visible);
+
+	if(fb->stream)
+		framebuffer_write_frame(fb, fb->stream);
+
+	if(fb->ppm_pattern) {
+		char file[4096];
+		// The pattern was checked by framebuffer_init
+		if(fb->ppm_long_long)
+			snprintf(file, sizeof(file), fb->ppm_pattern, fb->frame_count);
+		else
+			snprintf(file, sizeof(file), fb->ppm_pattern, (unsigned)fb->frame_count);
+		framebuffer_write_ppm(fb, file);
+	}
+
+	fb->frame_count++;
+}
+
+/* Returns the blink phase at the given cycle. */
+static int framebuffer_blink_visible(unsigned long long cycle)
+{
+	return ((cycle * FRAMEBUFFER_BLINK_HZ * 2) / DCPU16_CLOCK_HZ) % 2 == 0;
+}
+
+/* Called from the screen device batch function. Draws and writes every frame that is due and asks to be called
+   again when the next one is. */
+void framebuffer_batch(framebuffer_t *fb, screen_t *screen, dcpu16_t *computer)
+{
+	unsigned long long now = computer->stats.cycles;
+
+	if(!fb->started) {
+		fb->started = 1;
+		fb->start_cycle = now;
+		fb->next_frame_cycle = now;
+	}
+
+	while(now >= fb->next_frame_cycle) {
+		framebuffer_emit(fb, screen, framebuffer_blink_visible(fb->next_frame_cycle));
+		fb->next_frame_cycle = fb->start_cycle + fb->frame_count * DCPU16_CLOCK_HZ / fb->fps;
+	}
+
+	dcpu16_request_wakeup(computer, fb->next_frame_cycle);
+}
+
+/* Writes one last frame when the program stops if anything was written since the last frame, so the output
+   always ends with the final screen. */
+void framebuffer_flush(framebuffer_t *fb, screen_t *screen, const dcpu16_t *computer)
+{
+	int dirty = fb->full_redraw;
+
+	for(unsigned i = 0; !dirty && i < SCREEN_COLUMNS * SCREEN_ROWS; i++)
+		dirty = screen->dirty[i];
+
+	if(dirty)
+		framebuffer_emit(fb, screen, framebuffer_blink_visible(computer->stats.cycles));
+}
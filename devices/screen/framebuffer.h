@@ -0,0 +1,52 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "screen.h"
+
+/* Headless renderer for the screen device. Cells are drawn with the built in font ROM and palette into a
+   32-bit (0x00RRGGBB) framebuffer, only cells that were written (or blink) are redrawn. Frames are drawn
+   at a fixed rate of emulated time and written as a raw RGB24 stream and/or as numbered PPM files. */
+
+#define FRAMEBUFFER_GLYPH_WIDTH			4
+#define FRAMEBUFFER_GLYPH_HEIGHT		8
+#define FRAMEBUFFER_WIDTH			(SCREEN_COLUMNS * FRAMEBUFFER_GLYPH_WIDTH)
+#define FRAMEBUFFER_HEIGHT			(SCREEN_ROWS * FRAMEBUFFER_GLYPH_HEIGHT)
+
+#define FRAMEBUFFER_DEFAULT_FPS			30
+#define FRAMEBUFFER_BLINK_HZ			2
+
+typedef struct _framebuffer_t
+{
+	uint32_t pixels[FRAMEBUFFER_WIDTH * FRAMEBUFFER_HEIGHT];
+
+	// Blink phase the blinking cells were last drawn with, full_redraw forces every cell to be drawn
+	unsigned char blink_visible;
+	unsigned char full_redraw;
+
+	// Frame timing in emulated cycles, frame n is drawn at start_cycle + n * DCPU16_CLOCK_HZ / fps
+	unsigned fps;
+	unsigned char started;
+	unsigned long long start_cycle;
+	unsigned long long next_frame_cycle;
+	unsigned long long frame_count;
+
+	// Outputs (either may be 0)
+	FILE * stream;
+	const char * ppm_pattern;
+
+	// The conversion in ppm_pattern takes a long long (see framebuffer_check_pattern)
+	unsigned char ppm_long_long;
+
+} framebuffer_t;
+
+int framebuffer_check_pattern(const char *pattern);
+void framebuffer_init(framebuffer_t *fb, unsigned fps, FILE *stream, const char *ppm_pattern);
+void framebuffer_render(framebuffer_t *fb, screen_t *screen, int blink_visible);
+int framebuffer_write_frame(const framebuffer_t *fb, FILE *f);
+int framebuffer_write_ppm(const framebuffer_t *fb, const char *file);
+void framebuffer_batch(framebuffer_t *fb, screen_t *screen, dcpu16_t *computer);
+void framebuffer_flush(framebuffer_t *fb, screen_t *screen, const dcpu16_t *computer);
+
+#endif // FRAMEBUFFER_H
@@ -1,33 +1,92 @@
+#include <stdlib.h>
+#include <string.h>
 #include "screen.h"
+#include "framebuffer.h"
 
-screen_t * screen_create_device(dcpu16_device_t * dev)
+static void screen_write(dcpu16_device_t * dev, DCPU16_WORD address, DCPU16_WORD value)
 {
-	dev->ram_start_address = SCREEN_RAM_START_ADDRESS;
-	dev->ram_end_address = SCREEN_RAM_END_ADDRESS;
+	screen_t * screen = dev->struct_ptr;
 
-	dev->write = screen_write;
-	dev->read = screen_read;
+	screen->screen_buffer[address] = value;
+	screen->dirty[address] = 1;
+
+	if(screen->screen_changed_callback)
+		screen->screen_changed_callback(address % SCREEN_COLUMNS, address / SCREEN_COLUMNS, value);
+}
+
+static DCPU16_WORD screen_read(dcpu16_device_t * dev, DCPU16_WORD address)
+{
+	screen_t * screen = dev->struct_ptr;
 
-	dev->struct_ptr = malloc(sizeof(screen_t));
+	return screen->screen_buffer[address];
+}
 
-	return dev.struct_ptr;
+/* Lets the renderer draw every frame that is due. */
+static void screen_batch(dcpu16_device_t * dev)
+{
+	screen_t * screen = dev->struct_ptr;
+
+	if(screen->framebuffer)
+		framebuffer_batch(screen->framebuffer, screen, dev->computer);
 }
 
-void screen_release_device(dcpu16_device_t * dev)
+static unsigned screen_state_size(dcpu16_device_t * dev)
 {
-	free(dev.struct_ptr);
+	return sizeof(((screen_t *)0)->screen_buffer);
 }
 
-static void screen_write(dcpu16_device_t * dev, DCPU16_WORD address, DCPU16_WORD value)
+static void screen_save_state(dcpu16_device_t * dev, unsigned char * buffer)
 {
-	dev->screen_buffer[address] = value;
+	screen_t * screen = dev->struct_ptr;
 
-	if(dev->screen_changed_callback)
-		dev->screen_changed_callback(address / SCREEN_COLUMNS, address % SCREEN_COLUMNS, value);
+	memcpy(buffer, screen->screen_buffer, sizeof(screen->screen_buffer));
 }
 
-static DCPU16_WORD screen_read(dcpu16_device_t * dev, DCPU16_WORD address)
+static int screen_load_state(dcpu16_device_t * dev, const unsigned char * buffer, unsigned size)
+{
+	screen_t * screen = dev->struct_ptr;
+
+	if(size != sizeof(screen->screen_buffer))
+		return 0;
+
+	memcpy(screen->screen_buffer, buffer, sizeof(screen->screen_buffer));
+	memset(screen->dirty, 1, sizeof(screen->dirty));
+
+	return 1;
+}
+
+/* Clears the screen, every cell is drawn again. */
+static void screen_reset(dcpu16_device_t * dev)
+{
+	screen_t * screen = dev->struct_ptr;
+
+	memset(screen->screen_buffer, 0, sizeof(screen->screen_buffer));
+	memset(screen->dirty, 1, sizeof(screen->dirty));
+}
+
+screen_t * screen_create_device(dcpu16_device_t * dev)
 {
-	return dev->screen_buffer[address];
+	memset(dev, 0, sizeof(*dev));
+
+	dev->ram_start_address = SCREEN_RAM_START_ADDRESS;
+	dev->ram_end_address = SCREEN_RAM_END_ADDRESS;
+
+	dev->write = screen_write;
+	dev->read = screen_read;
+	dev->batch = screen_batch;
+	dev->reset = screen_reset;
+
+	dev->state_size = screen_state_size;
+	dev->save_state = screen_save_state;
+	dev->load_state = screen_load_state;
+
+	dev->struct_ptr = calloc(1, sizeof(screen_t));
+
+	return dev->struct_ptr;
 }
 
+void screen_release_device(dcpu16_device_t * dev)
+{
+	free(dev->struct_ptr);
+	dev->struct_ptr = 0;
+}
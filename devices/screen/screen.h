@@ -3,19 +3,35 @@
 
 #include "dcpu16.h"
 
-#define SCREEN_COLUMNS			// INSERT VALUE HERE
-#define SCREEN_ROWS			// INSERT VALUE HERE
+#define SCREEN_COLUMNS			32
+#define SCREEN_ROWS			12
 
-#define SCREEN_RAM_START_ADDRESS 	// INSERT VALUE HERE
-#define SCREEN_RAM_END_ADDRESS 		SCREEN_RAM_START_ADDRESS + SCREEN_COLUMNS * SCREEN_ROWS
+#define SCREEN_RAM_START_ADDRESS 	0x8000
+#define SCREEN_RAM_END_ADDRESS 		(SCREEN_RAM_START_ADDRESS + SCREEN_COLUMNS * SCREEN_ROWS - 1)
 
-screen_t * screen_create_device(dcpu16_device_t * dev);
-void screen_release_device(dcpu16_device_t * dev);
+/* Every cell is one word:
+   bits 0-6	character (glyph index)
+   bit 7	blink
+   bits 8-11	background colour
+   bits 12-15	foreground colour */
+#define SCREEN_CELL_CHARACTER(cell)	((cell) & 0x7F)
+#define SCREEN_CELL_BLINK(cell)		(((cell) >> 7) & 0x1)
+#define SCREEN_CELL_BACKGROUND(cell)	(((cell) >> 8) & 0xF)
+#define SCREEN_CELL_FOREGROUND(cell)	(((cell) >> 12) & 0xF)
 
-typedef struct _screen_t 
+typedef struct _screen_t
 {
 	DCPU16_WORD screen_buffer[SCREEN_COLUMNS * SCREEN_ROWS];
 	void (* screen_changed_callback)(char x, char y, DCPU16_WORD value);
+
+	// Cells written since the renderer last drew them
+	unsigned char dirty[SCREEN_COLUMNS * SCREEN_ROWS];
+
+	// Optional headless renderer, frames are drawn from the device batch function (see framebuffer.h)
+	struct _framebuffer_t * framebuffer;
 } screen_t;
 
+screen_t * screen_create_device(dcpu16_device_t * dev);
+void screen_release_device(dcpu16_device_t * dev);
+
 #endif
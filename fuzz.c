@@ -0,0 +1,287 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "fuzz.h"
+
+static const DCPU16_WORD fuzz_interesting_words[] = { 0x0000, 0x0001, 0x001F, 0x0020, 0x7FFF, 0x8000, 0xFFFE, 0xFFFF };
+
+/* Takes a snapshot of the computer (which should already have its program loaded) and starts recording coverage.
+   Returns false if an installed device can't save its state (inputs wouldn't start from the same machine). */
+int fuzz_init(fuzz_t *fuzz, dcpu16_t *computer, DCPU16_WORD input_address, unsigned max_input_words, unsigned max_instructions)
+{
+	memset(fuzz, 0, sizeof(*fuzz));
+
+	fuzz->computer = computer;
+	fuzz->input_address = input_address;
+	fuzz->max_input_words = max_input_words > FUZZ_DEFAULT_MAX_INPUT_WORDS ? FUZZ_DEFAULT_MAX_INPUT_WORDS : max_input_words;
+	fuzz->max_instructions = max_instructions;
+	fuzz->random_state = 0x2545F491;
+
+	memcpy(fuzz->snapshot_registers, computer->registers, sizeof(fuzz->snapshot_registers));
+	memcpy(fuzz->snapshot_ram, computer->ram, sizeof(fuzz->snapshot_ram));
+	fuzz->snapshot_stats = computer->stats;
+
+	for(int slot = 0; slot < DCPU16_DEVICE_SLOTS; slot++) {
+		dcpu16_device_t *dev = computer->devices[slot];
+		if(!dev)
+			continue;
+
+		if(!dev->state_size || !dev->save_state || !dev->load_state) {
+			fuzz_release(fuzz);
+			return 0;
+		}
+
+		fuzz->snapshot_device_sizes[slot] = dev->state_size(dev);
+		fuzz->snapshot_devices[slot] = malloc(fuzz->snapshot_device_sizes[slot] ? fuzz->snapshot_device_sizes[slot] : 1);
+		if(!fuzz->snapshot_devices[slot]) {
+			fuzz_release(fuzz);
+			return 0;
+		}
+
+		dev->save_state(dev, fuzz->snapshot_devices[slot]);
+	}
+
+	computer->coverage.bitmap = fuzz->trace;
+
+	// Start with a single empty input so there is always something to mutate
+	fuzz->corpus_count = 1;
+
+	return 1;
+}
+
+/* Stops recording coverage and frees the device snapshots. */
+void fuzz_release(fuzz_t *fuzz)
+{
+	fuzz->computer->coverage.bitmap = 0;
+
+	for(int slot = 0; slot < DCPU16_DEVICE_SLOTS; slot++) {
+		free(fuzz->snapshot_devices[slot]);
+		fuzz->snapshot_devices[slot] = 0;
+	}
+}
+
+/* Restores the snapshot, writes the input into RAM and runs until the program halts, crashes or runs out of instructions.
+   Returns one of the FUZZ_RESULT_* values. */
+int fuzz_run_input(fuzz_t *fuzz, const DCPU16_WORD *input, unsigned length)
+{
+	dcpu16_t *computer = fuzz->computer;
+
+	// Reset the machine without reloading the program
+	memcpy(computer->registers, fuzz->snapshot_registers, sizeof(computer->registers));
+	memcpy(computer->ram, fuzz->snapshot_ram, sizeof(computer->ram));
+	computer->stats = fuzz->snapshot_stats;
+
+	for(int slot = 0; slot < DCPU16_DEVICE_SLOTS; slot++) {
+		dcpu16_device_t *dev = computer->devices[slot];
+		if(dev && fuzz->snapshot_devices[slot])
+			dev->load_state(dev, fuzz->snapshot_devices[slot], fuzz->snapshot_device_sizes[slot]);
+	}
+
+	memset(fuzz->trace, 0, sizeof(fuzz->trace));
+	computer->coverage.previous_location = 0;
+	computer->fault = DCPU16_FAULT_NONE;
+
+	// Place the input (wrapping around the end of RAM like the CPU does)
+	for(unsigned i = 0; i < length; i++)
+		computer->ram[(DCPU16_WORD)(fuzz->input_address + i)] = input[i];
+
+	fuzz->executions++;
+
+	// Devices are called like dcpu16_run does, at the start and whenever one asked to be woken up
+	dcpu16_batch_devices(computer);
+
+	for(unsigned n = 0; n < fuzz->max_instructions; n++) {
+		DCPU16_WORD pc = computer->registers[DCPU16_INDEX_REG_PC];
+		computer->stats.cycles += dcpu16_step(computer);
+		computer->stats.instructions++;
+
+		if(computer->fault != DCPU16_FAULT_NONE) {
+			fuzz->crashes++;
+			fuzz->crash_pc = pc;
+			fuzz->crash_fault = computer->fault;
+			return FUZZ_RESULT_CRASH;
+		}
+
+		// An instruction that jumps to itself (hang: SET PC, hang) means the program is done
+		if(computer->registers[DCPU16_INDEX_REG_PC] == pc)
+			return FUZZ_RESULT_HALT;
+
+		if(computer->stats.cycles >= computer->wakeup_cycle)
+			dcpu16_batch_devices(computer);
+	}
+
+	fuzz->timeouts++;
+	return FUZZ_RESULT_TIMEOUT;
+}
+
+/* Maps a hit count to a single bit so that only significant changes in loop counts are considered new coverage. */
+static inline unsigned char fuzz_bucket(unsigned char count)
+{
+	if(count <= 3)
+		return count == 3 ? 4 : count;
+	if(count <= 7)
+		return 8;
+	if(count <= 15)
+		return 16;
+	if(count <= 31)
+		return 32;
+	if(count <= 127)
+		return 64;
+
+	return 128;
+}
+
+/* Returns true if the last input reached edges (or edge hit counts) that haven't been seen before. */
+int fuzz_has_new_coverage(fuzz_t *fuzz)
+{
+	int new_coverage = 0;
+
+	for(unsigned w = 0; w < sizeof(fuzz->trace); w += sizeof(uint64_t)) {
+		// Most of the bitmap is empty, skip eight entries at a time
+		uint64_t chunk;
+		memcpy(&chunk, &fuzz->trace[w], sizeof(chunk));
+		if(!chunk)
+			continue;
+
+		for(unsigned i = w; i < w + sizeof(chunk); i++) {
+			unsigned char bucket = fuzz_bucket(fuzz->trace[i]);
+
+			if(bucket & ~fuzz->seen[i]) {
+				if(!fuzz->seen[i])
+					fuzz->edges++;
+
+				fuzz->seen[i] |= bucket;
+				new_coverage = 1;
+			}
+		}
+	}
+
+	return new_coverage;
+}
+
+/* xorshift32 */
+static unsigned fuzz_random(fuzz_t *fuzz)
+{
+	unsigned x = fuzz->random_state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	fuzz->random_state = x;
+
+	return x;
+}
+
+/* Applies a few random mutations to the input. */
+static void fuzz_mutate(fuzz_t *fuzz, fuzz_input_t *input)
+{
+	unsigned mutations = 1 + fuzz_random(fuzz) % 4;
+
+	for(unsigned m = 0; m < mutations; m++) {
+		// Grow empty inputs first
+		if(input->length == 0) {
+			input->words[0] = fuzz_random(fuzz);
+			input->length = 1;
+			continue;
+		}
+
+		unsigned pos = fuzz_random(fuzz) % input->length;
+
+		switch(fuzz_random(fuzz) % 7) {
+		case 0:	// Flip a bit
+			input->words[pos] ^= 1 << (fuzz_random(fuzz) % 16);
+			break;
+		case 1:	// Random word
+			input->words[pos] = fuzz_random(fuzz);
+			break;
+		case 2:	// Interesting word
+			input->words[pos] = fuzz_interesting_words[fuzz_random(fuzz) % (sizeof(fuzz_interesting_words) / sizeof(*fuzz_interesting_words))];
+			break;
+		case 3:	// Small arithmetic
+			input->words[pos] += (fuzz_random(fuzz) % 33) - 16;
+			break;
+		case 4:	// Insert a word
+			if(input->length < fuzz->max_input_words) {
+				memmove(&input->words[pos + 1], &input->words[pos], (input->length - pos) * sizeof(DCPU16_WORD));
+				input->words[pos] = fuzz_random(fuzz);
+				input->length++;
+			}
+			break;
+		case 5:	// Remove a word
+			memmove(&input->words[pos], &input->words[pos + 1], (input->length - pos - 1) * sizeof(DCPU16_WORD));
+			input->length--;
+			break;
+		case 6:	// Splice with another corpus entry
+			{
+				const fuzz_input_t *other = &fuzz->corpus[fuzz_random(fuzz) % fuzz->corpus_count];
+				if(other->length > pos) {
+					memcpy(&input->words[pos], &other->words[pos], (other->length - pos) * sizeof(DCPU16_WORD));
+					input->length = other->length;
+				}
+			}
+			break;
+		};
+	}
+}
+
+/* Writes an input that crashed the program to a file (binary, little endian words), unless one with the same
+   fault at the same instruction was already saved. */
+static void fuzz_save_crash(fuzz_t *fuzz, const fuzz_input_t *input)
+{
+	unsigned char kind = 1 << fuzz->crash_fault;
+
+	if(fuzz->crashes_saved[fuzz->crash_pc] & kind)
+		return;
+
+	fuzz->crashes_saved[fuzz->crash_pc] |= kind;
+
+	char file[64];
+	snprintf(file, sizeof(file), "crash-%llu.bin", fuzz->crashes);
+
+	FILE *f = fopen(file, "wb");
+	if(!f)
+		return;
+
+	for(unsigned i = 0; i < input->length; i++) {
+		fputc(input->words[i] & 0xFF, f);
+		fputc(input->words[i] >> 8, f);
+	}
+
+	fclose(f);
+
+	PRINTF("Crash at pc %.4x saved to %s\n", fuzz->crash_pc, file);
+}
+
+/* Mutates inputs from the corpus and keeps those that find new coverage. Runs forever if iterations is 0. */
+void fuzz_loop(fuzz_t *fuzz, unsigned long long iterations)
+{
+	fuzz_input_t input;
+
+	PRINTF("DCPU16 emulator now fuzzing (input at %.4x, up to %u words)\n", fuzz->input_address, fuzz->max_input_words);
+
+	for(unsigned long long n = 0; iterations == 0 || n < iterations; n++) {
+		input = fuzz->corpus[fuzz_random(fuzz) % fuzz->corpus_count];
+		fuzz_mutate(fuzz, &input);
+
+		int result = fuzz_run_input(fuzz, input.words, input.length);
+
+		// Crashes are kept even when they took known paths, one input per faulting instruction and fault
+		if(result == FUZZ_RESULT_CRASH)
+			fuzz_save_crash(fuzz, &input);
+
+		if(fuzz_has_new_coverage(fuzz)) {
+			// Replace a random entry when the corpus is full
+			if(fuzz->corpus_count < FUZZ_CORPUS_SIZE)
+				fuzz->corpus[fuzz->corpus_count++] = input;
+			else
+				fuzz->corpus[fuzz_random(fuzz) % FUZZ_CORPUS_SIZE] = input;
+		}
+
+		if((fuzz->executions % 100000) == 0)
+			PRINTF("[ FUZZ ] executions: %llu | corpus: %u | edges: %u | crashes: %llu | timeouts: %llu\n",
+				fuzz->executions, fuzz->corpus_count, fuzz->edges, fuzz->crashes, fuzz->timeouts);
+	}
+
+	PRINTF("[ FUZZ ] executions: %llu | corpus: %u | edges: %u | crashes: %llu | timeouts: %llu\n",
+		fuzz->executions, fuzz->corpus_count, fuzz->edges, fuzz->crashes, fuzz->timeouts);
+}
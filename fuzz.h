@@ -0,0 +1,71 @@
+#ifndef FUZZ_H
+#define FUZZ_H
+
+#include "dcpu16.h"
+
+#define FUZZ_DEFAULT_INPUT_ADDRESS		0xF000
+#define FUZZ_DEFAULT_MAX_INPUT_WORDS		0x100
+#define FUZZ_DEFAULT_MAX_INSTRUCTIONS		100000
+
+#define FUZZ_CORPUS_SIZE			1024
+
+#define FUZZ_RESULT_HALT			0
+#define FUZZ_RESULT_TIMEOUT			1
+#define FUZZ_RESULT_CRASH			2
+
+typedef struct _fuzz_input_t
+{
+	unsigned length;
+	DCPU16_WORD words[FUZZ_DEFAULT_MAX_INPUT_WORDS];
+} fuzz_input_t;
+
+typedef struct _fuzz_t
+{
+	dcpu16_t * computer;
+
+	// Machine state restored before every input (taken by fuzz_init)
+	DCPU16_WORD snapshot_registers[DCPU16_REGISTER_COUNT];
+	DCPU16_WORD snapshot_ram[DCPU16_RAM_SIZE];
+	struct stats snapshot_stats;
+
+	// Saved state of every installed device (all of them must have state functions)
+	unsigned char * snapshot_devices[DCPU16_DEVICE_SLOTS];
+	unsigned snapshot_device_sizes[DCPU16_DEVICE_SLOTS];
+
+	// Where the input is written and how long a single input may run
+	DCPU16_WORD input_address;
+	unsigned max_input_words;
+	unsigned max_instructions;
+
+	// Coverage of the current input and all the (bucketed) coverage seen so far
+	unsigned char trace[DCPU16_COVERAGE_MAP_SIZE];
+	unsigned char seen[DCPU16_COVERAGE_MAP_SIZE];
+
+	// Inputs that found new coverage
+	fuzz_input_t corpus[FUZZ_CORPUS_SIZE];
+	unsigned corpus_count;
+
+	// Fault kinds (bit 1 << DCPU16_FAULT_*) already saved per faulting instruction address
+	unsigned char crashes_saved[DCPU16_RAM_SIZE];
+
+	// Where the last crashing input faulted
+	DCPU16_WORD crash_pc;
+	unsigned char crash_fault;
+
+	// Statistics
+	unsigned long long executions;
+	unsigned long long crashes;
+	unsigned long long timeouts;
+	unsigned edges;
+
+	unsigned random_state;
+
+} fuzz_t;
+
+int fuzz_init(fuzz_t *fuzz, dcpu16_t *computer, DCPU16_WORD input_address, unsigned max_input_words, unsigned max_instructions);
+void fuzz_release(fuzz_t *fuzz);
+int fuzz_run_input(fuzz_t *fuzz, const DCPU16_WORD *input, unsigned length);
+int fuzz_has_new_coverage(fuzz_t *fuzz);
+void fuzz_loop(fuzz_t *fuzz, unsigned long long iterations);
+
+#endif // FUZZ_H
@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <string.h>
+#include "heatmap.h"
+
+/* Clears the counters and attaches the heatmap to the computer. */
+void heatmap_init(heatmap_t *heatmap, dcpu16_t *computer)
+{
+	memset(heatmap, 0, sizeof(*heatmap));
+
+	heatmap->sample_interval = 1;
+	computer->heatmap = heatmap;
+}
+
+void heatmap_release(heatmap_t *heatmap, dcpu16_t *computer)
+{
+	if(computer->heatmap == heatmap)
+		computer->heatmap = 0;
+}
+
+/* Counts an access to a memory mapped device. */
+void heatmap_device_access(heatmap_t *heatmap, const dcpu16_t *computer, const dcpu16_device_t *dev, char write)
+{
+	for(int slot = 0; slot < DCPU16_DEVICE_SLOTS; slot++) {
+		if(computer->devices[slot] == dev) {
+			if(write)
+				heatmap->device_writes[slot]++;
+			else
+				heatmap->device_reads[slot]++;
+
+			return;
+		}
+	}
+}
+
+/* Records the working set since the previous sample. */
+void heatmap_sample(heatmap_t *heatmap, const dcpu16_t *computer)
+{
+	if(heatmap->stack_depth > heatmap->max_stack_depth)
+		heatmap->max_stack_depth = heatmap->stack_depth;
+
+	// Only every sample_interval:th call is recorded
+	if(++heatmap->sample_skip >= heatmap->sample_interval) {
+		heatmap->sample_skip = 0;
+
+		// Out of room, keep every other sample and sample half as often from now on
+		if(heatmap->sample_count == HEATMAP_MAX_SAMPLES) {
+			for(unsigned i = 0; i < HEATMAP_MAX_SAMPLES / 2; i++)
+				heatmap->samples[i] = heatmap->samples[i * 2 + 1];
+
+			heatmap->sample_count = HEATMAP_MAX_SAMPLES / 2;
+			heatmap->sample_interval *= 2;
+		}
+
+		heatmap_sample_t *sample = &heatmap->samples[heatmap->sample_count++];
+		sample->instructions = computer->stats.instructions;
+		sample->pages = 0;
+		sample->pages_written = 0;
+		sample->stack_depth = heatmap->stack_depth;
+
+		for(int p = 0; p < HEATMAP_PAGE_COUNT; p++) {
+			if(heatmap->touched[p])
+				sample->pages++;
+			if(heatmap->touched[p] & 2)
+				sample->pages_written++;
+		}
+
+		memset(heatmap->touched, 0, sizeof(heatmap->touched));
+		heatmap->stack_depth = 0;
+	}
+}
+
+/* Writes the page counters, device counters and working set samples as comma separated values. Returns true on success. */
+int heatmap_export(const heatmap_t *heatmap, const dcpu16_t *computer, const char *file)
+{
+	FILE *f = fopen(file, "w");
+	if(!f)
+		return 0;
+
+	unsigned touched_pages = 0;
+	for(int p = 0; p < HEATMAP_PAGE_COUNT; p++) {
+		if(heatmap->page_reads[p] || heatmap->page_writes[p] || heatmap->page_fetches[p])
+			touched_pages++;
+	}
+
+	fprintf(f, "# instructions,pages touched,page size (words),max stack depth (words)\n");
+	fprintf(f, "%llu,%u,%d,%u\n\n", computer->stats.instructions, touched_pages, HEATMAP_PAGE_WORDS,
+		heatmap->max_stack_depth > heatmap->stack_depth ? heatmap->max_stack_depth : heatmap->stack_depth);
+
+	fprintf(f, "# page start,reads,writes,fetches\n");
+	for(int p = 0; p < HEATMAP_PAGE_COUNT; p++) {
+		if(heatmap->page_reads[p] || heatmap->page_writes[p] || heatmap->page_fetches[p])
+			fprintf(f, "%.4x,%llu,%llu,%llu\n", p * HEATMAP_PAGE_WORDS,
+				heatmap->page_reads[p], heatmap->page_writes[p], heatmap->page_fetches[p]);
+	}
+
+	fprintf(f, "\n# device slot,start,end,reads,writes\n");
+	for(int slot = 0; slot < DCPU16_DEVICE_SLOTS; slot++) {
+		if(computer->devices[slot] || heatmap->device_reads[slot] || heatmap->device_writes[slot])
+			fprintf(f, "%d,%.4x,%.4x,%llu,%llu\n", slot,
+				computer->devices[slot] ? computer->devices[slot]->ram_start_address : 0,
+				computer->devices[slot] ? computer->devices[slot]->ram_end_address : 0,
+				heatmap->device_reads[slot], heatmap->device_writes[slot]);
+	}
+
+	fprintf(f, "\n# instructions,pages touched,pages written,stack depth (working set per sample)\n");
+	for(unsigned i = 0; i < heatmap->sample_count; i++) {
+		const heatmap_sample_t *sample = &heatmap->samples[i];
+		fprintf(f, "%llu,%u,%u,%u\n", sample->instructions, sample->pages, sample->pages_written, sample->stack_depth);
+	}
+
+	int ok = !ferror(f);
+	if(fclose(f) != 0)
+		ok = 0;
+
+	return ok;
+}
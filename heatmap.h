@@ -0,0 +1,80 @@
+#ifndef HEATMAP_H
+#define HEATMAP_H
+
+#include "dcpu16.h"
+
+/* The heatmap counts RAM reads, writes and instruction fetches per page and accesses per device slot,
+   and tracks how deep the stack grows. Every time heatmap_sample is called (at the end of every batch
+   in dcpu16_run) the number of pages touched since the previous sample is recorded, which gives the
+   working set size over time. */
+
+#define HEATMAP_PAGE_WORDS			256
+#define HEATMAP_PAGE_COUNT			(DCPU16_RAM_SIZE / HEATMAP_PAGE_WORDS)
+#define HEATMAP_MAX_SAMPLES			4096
+
+typedef struct _heatmap_sample_t
+{
+	unsigned long long instructions;
+	unsigned short pages;
+	unsigned short pages_written;
+	DCPU16_WORD stack_depth;
+} heatmap_sample_t;
+
+typedef struct _heatmap_t
+{
+	unsigned long long page_reads[HEATMAP_PAGE_COUNT];
+	unsigned long long page_writes[HEATMAP_PAGE_COUNT];
+	unsigned long long page_fetches[HEATMAP_PAGE_COUNT];
+
+	unsigned long long device_reads[DCPU16_DEVICE_SLOTS];
+	unsigned long long device_writes[DCPU16_DEVICE_SLOTS];
+
+	// Pages touched since the last sample (bit 0 read/fetched, bit 1 written)
+	unsigned char touched[HEATMAP_PAGE_COUNT];
+
+	// Deepest stack since the last sample and overall
+	DCPU16_WORD stack_depth;
+	DCPU16_WORD max_stack_depth;
+
+	// Working set over time, when full every other sample is dropped and the interval doubles
+	heatmap_sample_t samples[HEATMAP_MAX_SAMPLES];
+	unsigned sample_count;
+	unsigned sample_interval;
+	unsigned sample_skip;
+
+} heatmap_t;
+
+void heatmap_init(heatmap_t *heatmap, dcpu16_t *computer);
+void heatmap_release(heatmap_t *heatmap, dcpu16_t *computer);
+void heatmap_device_access(heatmap_t *heatmap, const dcpu16_t *computer, const dcpu16_device_t *dev, char write);
+void heatmap_sample(heatmap_t *heatmap, const dcpu16_t *computer);
+int heatmap_export(const heatmap_t *heatmap, const dcpu16_t *computer, const char *file);
+
+static inline void heatmap_read(heatmap_t *heatmap, DCPU16_WORD address)
+{
+	heatmap->page_reads[address / HEATMAP_PAGE_WORDS]++;
+	heatmap->touched[address / HEATMAP_PAGE_WORDS] |= 1;
+}
+
+static inline void heatmap_write(heatmap_t *heatmap, DCPU16_WORD address)
+{
+	heatmap->page_writes[address / HEATMAP_PAGE_WORDS]++;
+	heatmap->touched[address / HEATMAP_PAGE_WORDS] |= 2;
+}
+
+static inline void heatmap_fetch(heatmap_t *heatmap, DCPU16_WORD address)
+{
+	heatmap->page_fetches[address / HEATMAP_PAGE_WORDS]++;
+	heatmap->touched[address / HEATMAP_PAGE_WORDS] |= 1;
+}
+
+/* The stack grows down from 0x10000, SP 0 means it's empty. */
+static inline void heatmap_stack(heatmap_t *heatmap, DCPU16_WORD sp)
+{
+	DCPU16_WORD depth = -sp;
+
+	if(depth > heatmap->stack_depth)
+		heatmap->stack_depth = depth;
+}
+
+#endif // HEATMAP_H
@@ -0,0 +1,255 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "metrics.h"
+
+/* Keeps the compiler from reordering stores around the sequence updates. */
+#define METRICS_STORE_FENCE()		__atomic_thread_fence(__ATOMIC_RELEASE)
+#define METRICS_LOAD_FENCE()		__atomic_thread_fence(__ATOMIC_ACQUIRE)
+
+static double metrics_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (double)ts.tv_sec + ((double)ts.tv_nsec * 0.000000001);
+}
+
+/* Maps the shared memory segment, creating it if it doesn't exist. Returns the size of the mapping or 0 on failure. */
+static size_t metrics_map(const char *name, uint32_t slot_count, int create, metrics_header_t **header)
+{
+	int created = 0;
+	int fd = -1;
+
+	if(create) {
+		fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+		created = fd >= 0;
+	}
+
+	if(fd < 0)
+		fd = shm_open(name, create ? O_RDWR : O_RDONLY, 0);
+
+	if(fd < 0)
+		return 0;
+
+	size_t size = sizeof(metrics_header_t) + (size_t)slot_count * sizeof(metrics_slot_t);
+
+	if(created) {
+		if(ftruncate(fd, size) != 0) {
+			close(fd);
+			shm_unlink(name);
+			return 0;
+		}
+	} else {
+		// Use the size of the existing segment, the creator may not have set it yet
+		struct timespec delay = { 0, 1000000 };
+		struct stat st;
+		int ok;
+
+		for(int i = 0; (ok = fstat(fd, &st) == 0) && (size_t)st.st_size < sizeof(metrics_header_t) && i < 1000; i++)
+			nanosleep(&delay, 0);
+
+		if(!ok || (size_t)st.st_size < sizeof(metrics_header_t)) {
+			close(fd);
+			return 0;
+		}
+
+		size = st.st_size;
+	}
+
+	void *p = mmap(0, size, create ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if(p == MAP_FAILED)
+		return 0;
+
+	*header = p;
+
+	if(created) {
+		(*header)->version = METRICS_VERSION;
+		(*header)->header_size = sizeof(metrics_header_t);
+		(*header)->slot_size = sizeof(metrics_slot_t);
+		(*header)->slot_count = slot_count;
+
+		// Publishing the magic last tells other processes the header is complete
+		__atomic_store_n(&(*header)->magic, METRICS_MAGIC, __ATOMIC_RELEASE);
+	} else {
+		// Wait for the creator to finish the header (this only happens once at startup)
+		struct timespec delay = { 0, 1000000 };
+		for(int i = 0; i < 1000 && __atomic_load_n(&(*header)->magic, __ATOMIC_ACQUIRE) != METRICS_MAGIC; i++)
+			nanosleep(&delay, 0);
+
+		if((*header)->magic != METRICS_MAGIC || (*header)->version != METRICS_VERSION ||
+		   (*header)->slot_size != sizeof(metrics_slot_t) ||
+		   size < sizeof(metrics_header_t) + (size_t)(*header)->slot_count * sizeof(metrics_slot_t)) {
+			munmap(p, size);
+			return 0;
+		}
+	}
+
+	return size;
+}
+
+/* Returns true if the process is gone (its slot can be reused). */
+static int metrics_pid_dead(uint32_t pid)
+{
+	return kill((pid_t)pid, 0) == -1 && errno == ESRCH;
+}
+
+/* Opens (or creates) the named segment and claims a slot for this instance. Returns true on success. */
+int metrics_open(metrics_t *metrics, const char *name, uint32_t slot_count)
+{
+	memset(metrics, 0, sizeof(*metrics));
+
+	metrics->size = metrics_map(name, slot_count, 1, &metrics->header);
+	if(!metrics->size)
+		return 0;
+
+	// Take the first free slot, or one left behind by an instance that is gone
+	metrics_slot_t *slots = (metrics_slot_t *)((char *)metrics->header + metrics->header->header_size);
+	uint32_t pid = getpid();
+	uint32_t index;
+
+	for(index = 0; index < metrics->header->slot_count; index++) {
+		uint32_t owner = __atomic_load_n(&slots[index].pid, __ATOMIC_ACQUIRE);
+
+		if((owner == 0 || metrics_pid_dead(owner)) &&
+		   __atomic_compare_exchange_n(&slots[index].pid, &owner, pid, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+			break;
+	}
+
+	if(index == metrics->header->slot_count) {
+		munmap(metrics->header, metrics->size);
+		memset(metrics, 0, sizeof(*metrics));
+		return 0;
+	}
+
+	// Raise the high water mark readers go up to
+	uint32_t claimed = __atomic_load_n(&metrics->header->slots_claimed, __ATOMIC_RELAXED);
+	while(claimed < index + 1 &&
+	      !__atomic_compare_exchange_n(&metrics->header->slots_claimed, &claimed, index + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+
+	metrics->slot_index = index;
+	metrics->slot = &slots[index];
+	metrics->rate_start_time = metrics_now();
+
+	// Clear what the previous owner left, its sequence may be odd if it died while publishing
+	metrics_slot_t *slot = metrics->slot;
+	uint32_t sequence = slot->sequence | 1;
+
+	slot->sequence = sequence;
+	METRICS_STORE_FENCE();
+	memset((char *)slot + offsetof(metrics_slot_t, instructions), 0, sizeof(*slot) - offsetof(metrics_slot_t, instructions));
+	METRICS_STORE_FENCE();
+	slot->sequence = sequence + 1;
+
+	return 1;
+}
+
+/* Releases the slot (readers don't list it anymore) and unmaps the segment. */
+void metrics_close(metrics_t *metrics)
+{
+	if(metrics->slot)
+		__atomic_store_n(&metrics->slot->pid, 0, __ATOMIC_RELEASE);
+
+	if(metrics->header)
+		munmap(metrics->header, metrics->size);
+
+	memset(metrics, 0, sizeof(*metrics));
+}
+
+/* Copies the counters of the computer into its slot. Meant to be called at batch boundaries. */
+void metrics_publish(metrics_t *metrics, const dcpu16_t *computer)
+{
+	metrics_slot_t *slot = metrics->slot;
+	double mhz = slot->mhz;
+
+	// Only look at the clock every METRICS_RATE_INTERVAL worth of instructions (clock_gettime doesn't enter the kernel on Linux)
+	unsigned long long instructions = computer->stats.instructions - metrics->rate_start_instructions;
+	if(instructions >= (unsigned long long)(DCPU16_BATCH_SIZE * 10) || computer->stop_reason != DCPU16_STOP_NONE) {
+		double now = metrics_now();
+		double elapsed = now - metrics->rate_start_time;
+
+		if(elapsed >= METRICS_RATE_INTERVAL || (computer->stop_reason != DCPU16_STOP_NONE && elapsed > 0.0)) {
+			mhz = (double)instructions / elapsed / 1000000.0;
+			metrics->rate_start_time = now;
+			metrics->rate_start_instructions = computer->stats.instructions;
+		}
+	}
+
+	uint32_t sequence = slot->sequence;
+
+	slot->sequence = sequence + 1;
+	METRICS_STORE_FENCE();
+
+	slot->instructions = computer->stats.instructions;
+	slot->cycles = computer->stats.cycles;
+	slot->device_reads = computer->stats.device_reads;
+	slot->device_writes = computer->stats.device_writes;
+	slot->faults = computer->stats.faults;
+	slot->halts = computer->stats.halts;
+	slot->mhz = mhz;
+	slot->stop_reason = computer->stop_reason;
+
+	METRICS_STORE_FENCE();
+	slot->sequence = sequence + 2;
+}
+
+/* Prints the slots of all instances publishing to the named segment. Returns true on success. */
+int metrics_print(const char *name)
+{
+	metrics_header_t *header;
+	size_t size = metrics_map(name, 0, 0, &header);
+
+	if(!size)
+		return 0;
+
+	const metrics_slot_t *slots = (const metrics_slot_t *)((const char *)header + header->header_size);
+	uint32_t count = header->slots_claimed < header->slot_count ? header->slots_claimed : header->slot_count;
+
+	PRINTF("slot   pid       instructions           cycles     dev reads    dev writes   faults halts      MHz stop\n");
+
+	for(uint32_t i = 0; i < count; i++) {
+		metrics_slot_t copy;
+		uint32_t before, after;
+		int tries = 0;
+
+		// Free slot
+		if(!__atomic_load_n(&slots[i].pid, __ATOMIC_ACQUIRE))
+			continue;
+
+		// Retry until we get a consistent copy, a writer that died mid update leaves the sequence odd
+		do {
+			before = __atomic_load_n(&slots[i].sequence, __ATOMIC_ACQUIRE);
+			memcpy(&copy, (const void *)&slots[i], sizeof(copy));
+			METRICS_LOAD_FENCE();
+			after = __atomic_load_n(&slots[i].sequence, __ATOMIC_RELAXED);
+		} while(((before & 1) || before != after) && ++tries < METRICS_READ_RETRIES);
+
+		if((before & 1) || before != after) {
+			PRINTF("%4u %6u torn%s\n", i, copy.pid, metrics_pid_dead(copy.pid) ? " (exited while publishing)" : "");
+			continue;
+		}
+
+		PRINTF("%4u %6u %18llu %16llu %13llu %13llu %8llu %5llu %8.2lf %4u\n",
+			i, copy.pid, (unsigned long long)copy.instructions, (unsigned long long)copy.cycles,
+			(unsigned long long)copy.device_reads, (unsigned long long)copy.device_writes,
+			(unsigned long long)copy.faults, (unsigned long long)copy.halts, copy.mhz, copy.stop_reason);
+
+		if(metrics_pid_dead(copy.pid))
+			PRINTF("     stale (the instance exited without closing the segment)\n");
+	}
+
+	munmap(header, size);
+
+	return 1;
+}
@@ -0,0 +1,72 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include "dcpu16.h"
+
+/* Live metrics are published in a POSIX shared memory segment (shm_open) that starts with a
+   metrics_header_t followed by slot_count metrics_slot_t, one slot per emulator instance.
+   The emulator only does plain stores. A reader copies a slot and accepts the copy if
+   sequence was even and unchanged before and after copying it, a slot that stays odd belonged to an
+   instance that died while publishing and is reported as torn.
+
+   An instance claims the first slot whose pid is 0 or no longer running and clears the pid again when
+   it closes the segment, so slots are reused. slots_claimed is the highest slot index ever used + 1. */
+
+#define METRICS_MAGIC				0x544D4344	// "DCMT"
+#define METRICS_VERSION				1
+#define METRICS_DEFAULT_SLOTS			4096
+
+// Recompute MHz at most this often
+#define METRICS_RATE_INTERVAL			1.0
+
+// Copies a reader tries before it reports a slot as torn
+#define METRICS_READ_RETRIES			1000
+
+typedef struct _metrics_header_t
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t header_size;
+	uint32_t slot_size;
+	uint32_t slot_count;
+	uint32_t slots_claimed;
+	uint32_t reserved[2];
+} metrics_header_t;
+
+typedef struct _metrics_slot_t
+{
+	// Odd while the slot is being written
+	uint32_t sequence;
+	uint32_t pid;
+
+	uint64_t instructions;
+	uint64_t cycles;
+	uint64_t device_reads;
+	uint64_t device_writes;
+	uint64_t faults;
+	uint64_t halts;
+	double mhz;
+	uint32_t stop_reason;
+	uint32_t reserved[5];
+} metrics_slot_t;
+
+typedef struct _metrics_t
+{
+	metrics_header_t * header;
+	metrics_slot_t * slot;
+	uint32_t slot_index;
+	size_t size;
+
+	// Used for calculating MHz
+	double rate_start_time;
+	unsigned long long rate_start_instructions;
+
+} metrics_t;
+
+int metrics_open(metrics_t *metrics, const char *name, uint32_t slot_count);
+void metrics_close(metrics_t *metrics);
+void metrics_publish(metrics_t *metrics, const dcpu16_t *computer);
+int metrics_print(const char *name);
+
+#endif // METRICS_H
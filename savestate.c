@@ -0,0 +1,560 @@
+#define _XOPEN_SOURCE 700
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include "savestate.h"
+
+static const char savestate_magic[8] = { 'D', 'C', 'P', 'U', 'S', 'A', 'V', 'E' };
+
+/* Compressed pages are a sequence of tokens:
+   0x00-0x7F	literal run, (token + 1) words follow
+   0x80-0xBF	zero run of (token - 0x7F) words
+   0xC0-0xFF	copy (token - 0xBE) words starting (next byte + 1) words back, the source may overlap the output */
+#define SAVESTATE_TOKEN_ZERO			0x80
+#define SAVESTATE_TOKEN_COPY			0xC0
+#define SAVESTATE_MAX_LITERAL_RUN		128
+#define SAVESTATE_MAX_ZERO_RUN			64
+#define SAVESTATE_MIN_COPY			2
+#define SAVESTATE_MAX_COPY			65
+#define SAVESTATE_HASH_BITS			8
+
+/* FNV-1a of the registers and RAM. Used to make sure a delta is applied to the right base state. */
+unsigned savestate_hash(const dcpu16_t *computer)
+{
+	unsigned hash = 2166136261u;
+	const unsigned char *p;
+
+	p = (const unsigned char *)computer->registers;
+	for(unsigned i = 0; i < sizeof(computer->registers); i++)
+		hash = (hash ^ p[i]) * 16777619u;
+
+	p = (const unsigned char *)computer->ram;
+	for(unsigned i = 0; i < sizeof(computer->ram); i++)
+		hash = (hash ^ p[i]) * 16777619u;
+
+	return hash;
+}
+
+static inline unsigned char *savestate_put_word(unsigned char *out, DCPU16_WORD w)
+{
+	out[0] = w & 0xFF;
+	out[1] = w >> 8;
+
+	return out + 2;
+}
+
+/* Emits the pending literal words [start, end). */
+static unsigned char *savestate_flush_literals(unsigned char *out, const DCPU16_WORD *page, unsigned start, unsigned end)
+{
+	while(start < end) {
+		unsigned run = end - start;
+		if(run > SAVESTATE_MAX_LITERAL_RUN)
+			run = SAVESTATE_MAX_LITERAL_RUN;
+
+		*out++ = run - 1;
+		for(unsigned i = 0; i < run; i++)
+			out = savestate_put_word(out, page[start + i]);
+
+		start += run;
+	}
+
+	return out;
+}
+
+/* Compresses one page into out (which must hold SAVESTATE_MAX_COMPRESSED_PAGE bytes). Returns the compressed size. */
+unsigned savestate_compress_page(const DCPU16_WORD *page, unsigned char *out)
+{
+	// Last position where each (hashed) pair of words was seen
+	short last_seen[1 << SAVESTATE_HASH_BITS];
+	memset(last_seen, -1, sizeof(last_seen));
+
+	unsigned char *start = out;
+	unsigned literal_start = 0;
+	unsigned i = 0;
+
+	while(i < SAVESTATE_PAGE_WORDS) {
+		// Zero run (a single zero is only worth it if it doesn't split a literal run)
+		unsigned zeros = 0;
+		while(i + zeros < SAVESTATE_PAGE_WORDS && zeros < SAVESTATE_MAX_ZERO_RUN && page[i + zeros] == 0)
+			zeros++;
+
+		if(zeros >= 2 || (zeros == 1 && literal_start == i)) {
+			out = savestate_flush_literals(out, page, literal_start, i);
+			*out++ = SAVESTATE_TOKEN_ZERO + zeros - 1;
+			i += zeros;
+			literal_start = i;
+			continue;
+		}
+
+		// Copy of earlier words
+		unsigned length = 0;
+		unsigned offset = 0;
+
+		if(i + SAVESTATE_MIN_COPY <= SAVESTATE_PAGE_WORDS) {
+			unsigned h = ((page[i] * 0x9E37u) ^ page[i + 1]) & ((1 << SAVESTATE_HASH_BITS) - 1);
+			int candidate = last_seen[h];
+			last_seen[h] = i;
+
+			if(candidate >= 0) {
+				while(i + length < SAVESTATE_PAGE_WORDS && length < SAVESTATE_MAX_COPY &&
+				      page[candidate + length] == page[i + length])
+					length++;
+
+				offset = i - candidate;
+			}
+		}
+
+		if(length >= SAVESTATE_MIN_COPY) {
+			out = savestate_flush_literals(out, page, literal_start, i);
+			*out++ = SAVESTATE_TOKEN_COPY + length - SAVESTATE_MIN_COPY;
+			*out++ = offset - 1;
+			i += length;
+			literal_start = i;
+		} else {
+			i++;
+		}
+	}
+
+	out = savestate_flush_literals(out, page, literal_start, i);
+
+	return out - start;
+}
+
+/* Decompresses one page. Returns true if the data was valid and filled the whole page. */
+int savestate_decompress_page(const unsigned char *in, unsigned size, DCPU16_WORD *page)
+{
+	const unsigned char *end = in + size;
+	unsigned i = 0;
+
+	while(in < end) {
+		unsigned char token = *in++;
+
+		if(token < SAVESTATE_TOKEN_ZERO) {
+			unsigned run = token + 1;
+			if(i + run > SAVESTATE_PAGE_WORDS || in + run * 2 > end)
+				return 0;
+
+			for(; run; run--, in += 2)
+				page[i++] = in[0] | (in[1] << 8);
+		} else if(token < SAVESTATE_TOKEN_COPY) {
+			unsigned run = token - SAVESTATE_TOKEN_ZERO + 1;
+			if(i + run > SAVESTATE_PAGE_WORDS)
+				return 0;
+
+			memset(&page[i], 0, run * sizeof(DCPU16_WORD));
+			i += run;
+		} else {
+			if(in >= end)
+				return 0;
+
+			unsigned length = token - SAVESTATE_TOKEN_COPY + SAVESTATE_MIN_COPY;
+			unsigned offset = *in++ + 1;
+			if(offset > i || i + length > SAVESTATE_PAGE_WORDS)
+				return 0;
+
+			// Word by word, the source may overlap what is being written
+			for(; length; length--, i++)
+				page[i] = page[i - offset];
+		}
+	}
+
+	return i == SAVESTATE_PAGE_WORDS;
+}
+
+static void savestate_write_u16(FILE *f, unsigned v)
+{
+	fputc(v & 0xFF, f);
+	fputc((v >> 8) & 0xFF, f);
+}
+
+static void savestate_write_u32(FILE *f, unsigned v)
+{
+	savestate_write_u16(f, v & 0xFFFF);
+	savestate_write_u16(f, v >> 16);
+}
+
+static void savestate_write_u64(FILE *f, unsigned long long v)
+{
+	savestate_write_u32(f, (unsigned)(v & 0xFFFFFFFF));
+	savestate_write_u32(f, (unsigned)(v >> 32));
+}
+
+static unsigned savestate_read_u16(FILE *f)
+{
+	unsigned v = fgetc(f) & 0xFF;
+	return v | ((fgetc(f) & 0xFF) << 8);
+}
+
+static unsigned savestate_read_u32(FILE *f)
+{
+	unsigned v = savestate_read_u16(f);
+	return v | (savestate_read_u16(f) << 16);
+}
+
+static unsigned long long savestate_read_u64(FILE *f)
+{
+	unsigned long long v = savestate_read_u32(f);
+	return v | ((unsigned long long)savestate_read_u32(f) << 32);
+}
+
+/* Length of the directory part of a path (including the last '/'), 0 if there is none. */
+static unsigned savestate_directory_length(const char *file)
+{
+	const char *slash = strrchr(file, '/');
+
+	return slash ? slash - file + 1 : 0;
+}
+
+/* Writes the path of base_file as seen from the directory of file into out. Returns false if it doesn't fit. */
+static int savestate_base_path(const char *file, const char *base_file, char *out, unsigned size)
+{
+	unsigned directory = savestate_directory_length(file);
+
+	if(base_file[0] == '/' || directory == 0) {
+		// Absolute, or both relative to the working directory
+		if(strlen(base_file) >= size)
+			return 0;
+
+		strcpy(out, base_file);
+	} else if(strncmp(base_file, file, directory) == 0 && strlen(base_file + directory) < size) {
+		// In the same directory (or below it)
+		strcpy(out, base_file + directory);
+	} else {
+		char resolved[PATH_MAX];
+		if(!realpath(base_file, resolved) || strlen(resolved) >= size)
+			return 0;
+
+		strcpy(out, resolved);
+	}
+
+	return 1;
+}
+
+/* Returns true if both paths exist and are the same file (links included). */
+int savestate_same_file(const char *a, const char *b)
+{
+	struct stat sa, sb;
+
+	return stat(a, &sa) == 0 && stat(b, &sb) == 0 && sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+}
+
+/* Writes the state of the computer to file, returns true on success.
+   If base is set only the pages that differ from it are stored and loading the file will first load base_file. */
+int savestate_save(const dcpu16_t *computer, const char *file, const dcpu16_t *base, const char *base_file)
+{
+	static const DCPU16_WORD zero_page[SAVESTATE_PAGE_WORDS];
+
+	// Loading resolves the base relative to the directory of the delta
+	char base_path[PATH_MAX];
+	if(base && !savestate_base_path(file, base_file, base_path, sizeof(base_path)))
+		return 0;
+
+	// Opening the file truncates it, a delta written over its own base would destroy the state
+	if(base && savestate_same_file(file, base_file))
+		return 0;
+
+	FILE *f = fopen(file, "wb");
+	if(!f)
+		return 0;
+
+	setvbuf(f, 0, _IOFBF, SAVESTATE_IO_BUFFER_SIZE);
+
+	// Header
+	fwrite(savestate_magic, 1, sizeof(savestate_magic), f);
+	savestate_write_u16(f, SAVESTATE_VERSION);
+	savestate_write_u16(f, base ? SAVESTATE_FLAG_DELTA : 0);
+
+	if(base) {
+		unsigned length = strlen(base_path);
+
+		savestate_write_u32(f, savestate_hash(base));
+		savestate_write_u16(f, length);
+		fwrite(base_path, 1, length, f);
+	}
+
+	// Registers
+	for(int r = 0; r < DCPU16_REGISTER_COUNT; r++)
+		savestate_write_u16(f, computer->registers[r]);
+
+	savestate_write_u64(f, computer->stats.cycles);
+
+	// Page map, a page is stored if it differs from the base (or from zero)
+	unsigned char page_map[SAVESTATE_PAGE_COUNT / 8];
+	memset(page_map, 0, sizeof(page_map));
+
+	for(int p = 0; p < SAVESTATE_PAGE_COUNT; p++) {
+		const DCPU16_WORD *page = &computer->ram[p * SAVESTATE_PAGE_WORDS];
+		const DCPU16_WORD *base_page = base ? &base->ram[p * SAVESTATE_PAGE_WORDS] : zero_page;
+
+		if(memcmp(page, base_page, SAVESTATE_PAGE_WORDS * sizeof(DCPU16_WORD)) != 0)
+			page_map[p / 8] |= 1 << (p % 8);
+	}
+
+	fwrite(page_map, 1, sizeof(page_map), f);
+
+	// Pages
+	for(int p = 0; p < SAVESTATE_PAGE_COUNT; p++) {
+		if(!(page_map[p / 8] & (1 << (p % 8))))
+			continue;
+
+		DCPU16_WORD page[SAVESTATE_PAGE_WORDS];
+		unsigned char compressed[SAVESTATE_MAX_COMPRESSED_PAGE];
+
+		// XOR with the base so that unchanged words become zero runs
+		for(int w = 0; w < SAVESTATE_PAGE_WORDS; w++)
+			page[w] = computer->ram[p * SAVESTATE_PAGE_WORDS + w] ^ (base ? base->ram[p * SAVESTATE_PAGE_WORDS + w] : 0);
+
+		unsigned size = savestate_compress_page(page, compressed);
+		savestate_write_u16(f, size);
+		fwrite(compressed, 1, size, f);
+	}
+
+	// Devices
+	unsigned device_count = 0;
+	for(int slot = 0; slot < DCPU16_DEVICE_SLOTS; slot++) {
+		if(computer->devices[slot] && computer->devices[slot]->state_size && computer->devices[slot]->save_state)
+			device_count++;
+	}
+
+	savestate_write_u16(f, device_count);
+
+	for(int slot = 0; slot < DCPU16_DEVICE_SLOTS; slot++) {
+		dcpu16_device_t *dev = computer->devices[slot];
+		if(!dev || !dev->state_size || !dev->save_state)
+			continue;
+
+		unsigned size = dev->state_size(dev);
+		unsigned char *buffer = malloc(size ? size : 1);
+		if(!buffer) {
+			fclose(f);
+			return 0;
+		}
+
+		dev->save_state(dev, buffer);
+
+		savestate_write_u16(f, slot);
+		savestate_write_u32(f, size);
+		fwrite(buffer, 1, size, f);
+
+		free(buffer);
+	}
+
+	int ok = !ferror(f);
+
+	if(fclose(f) != 0)
+		ok = 0;
+
+	return ok;
+}
+
+/* A device chunk read from the file, applied once the whole file has been read. */
+typedef struct _savestate_device_chunk_t
+{
+	unsigned slot;
+	unsigned size;
+	unsigned char *data;
+} savestate_device_chunk_t;
+
+static void savestate_free_chunks(savestate_device_chunk_t *chunks, unsigned count)
+{
+	for(unsigned d = 0; d < count; d++)
+		free(chunks[d].data);
+}
+
+/* Reads the registers, RAM and cycles of file into state, loading its base states first. chain holds
+   the resolved paths of the deltas that led here. The device chunks of the file are read into chunks
+   (and skipped for base states, which pass 0). Returns true on success. */
+static int savestate_read(dcpu16_t *state, const char *file, char chain[][PATH_MAX], unsigned depth,
+			  savestate_device_chunk_t *chunks, unsigned *chunk_count)
+{
+	// A delta naming itself, directly or through other deltas, would never end
+	if(depth == SAVESTATE_MAX_CHAIN || !realpath(file, chain[depth]))
+		return 0;
+
+	for(unsigned d = 0; d < depth; d++) {
+		if(strcmp(chain[d], chain[depth]) == 0)
+			return 0;
+	}
+
+	FILE *f = fopen(file, "rb");
+	if(!f)
+		return 0;
+
+	setvbuf(f, 0, _IOFBF, SAVESTATE_IO_BUFFER_SIZE);
+
+	char magic[sizeof(savestate_magic)];
+	if(fread(magic, 1, sizeof(magic), f) != sizeof(magic) || memcmp(magic, savestate_magic, sizeof(magic)) != 0 ||
+	   savestate_read_u16(f) != SAVESTATE_VERSION) {
+		fclose(f);
+		return 0;
+	}
+
+	unsigned flags = savestate_read_u16(f);
+
+	if(flags & SAVESTATE_FLAG_DELTA) {
+		unsigned hash = savestate_read_u32(f);
+		unsigned length = savestate_read_u16(f);
+
+		// The base path is relative to the directory of the delta
+		unsigned directory = savestate_directory_length(file);
+		char *base_file = malloc(directory + length + 1);
+		if(!base_file || fread(base_file + directory, 1, length, f) != length) {
+			free(base_file);
+			fclose(f);
+			return 0;
+		}
+
+		base_file[directory + length] = 0;
+
+		if(base_file[directory] == '/') {
+			memmove(base_file, base_file + directory, length + 1);
+		} else {
+			memcpy(base_file, file, directory);
+		}
+
+		int ok = savestate_read(state, base_file, chain, depth + 1, 0, 0) && savestate_hash(state) == hash;
+		free(base_file);
+
+		if(!ok) {
+			fclose(f);
+			return 0;
+		}
+	} else {
+		memset(state->registers, 0, sizeof(state->registers));
+		memset(state->ram, 0, sizeof(state->ram));
+	}
+
+	// Registers
+	for(int r = 0; r < DCPU16_REGISTER_COUNT; r++)
+		state->registers[r] = savestate_read_u16(f);
+
+	state->stats.cycles = savestate_read_u64(f);
+
+	// Pages
+	unsigned char page_map[SAVESTATE_PAGE_COUNT / 8];
+	if(fread(page_map, 1, sizeof(page_map), f) != sizeof(page_map)) {
+		fclose(f);
+		return 0;
+	}
+
+	for(int p = 0; p < SAVESTATE_PAGE_COUNT; p++) {
+		if(!(page_map[p / 8] & (1 << (p % 8))))
+			continue;
+
+		DCPU16_WORD page[SAVESTATE_PAGE_WORDS];
+		unsigned char compressed[SAVESTATE_MAX_COMPRESSED_PAGE];
+		unsigned size = savestate_read_u16(f);
+
+		if(size > sizeof(compressed) || fread(compressed, 1, size, f) != size ||
+		   !savestate_decompress_page(compressed, size, page)) {
+			fclose(f);
+			return 0;
+		}
+
+		for(int w = 0; w < SAVESTATE_PAGE_WORDS; w++)
+			state->ram[p * SAVESTATE_PAGE_WORDS + w] ^= page[w];
+	}
+
+	// Devices
+	unsigned device_count = savestate_read_u16(f);
+
+	for(unsigned d = 0; d < device_count; d++) {
+		unsigned slot = savestate_read_u16(f);
+		unsigned size = savestate_read_u32(f);
+
+		if(feof(f) || slot >= DCPU16_DEVICE_SLOTS || (chunks && *chunk_count == DCPU16_DEVICE_SLOTS)) {
+			fclose(f);
+			return 0;
+		}
+
+		// Base states only provide RAM, the devices are in the delta
+		if(!chunks) {
+			fseek(f, size, SEEK_CUR);
+			continue;
+		}
+
+		savestate_device_chunk_t *chunk = &chunks[(*chunk_count)++];
+		chunk->slot = slot;
+		chunk->size = size;
+		chunk->data = malloc(size ? size : 1);
+
+		if(!chunk->data || fread(chunk->data, 1, size, f) != size) {
+			fclose(f);
+			return 0;
+		}
+	}
+
+	int ok = !feof(f) && !ferror(f);
+	fclose(f);
+
+	return ok;
+}
+
+/* Loads a state written by savestate_save into the computer, returns true on success.
+   Delta states load their base state first. Installed devices and callbacks are kept.
+   The computer is only changed if the whole state (and all of its bases) could be loaded. */
+int savestate_load(dcpu16_t *computer, const char *file)
+{
+	dcpu16_t *state = malloc(sizeof(dcpu16_t));
+	char (*chain)[PATH_MAX] = malloc(SAVESTATE_MAX_CHAIN * sizeof(*chain));
+	savestate_device_chunk_t *chunks = calloc(DCPU16_DEVICE_SLOTS, sizeof(savestate_device_chunk_t));
+	unsigned chunk_count = 0;
+
+	int ok = state && chain && chunks && savestate_read(state, file, chain, 0, chunks, &chunk_count);
+
+	// Devices, chunks for slots without a matching device are skipped. The state of the devices that were
+	// restored is put back if a later one fails.
+	savestate_device_chunk_t *previous = ok ? calloc(DCPU16_DEVICE_SLOTS, sizeof(savestate_device_chunk_t)) : 0;
+	unsigned restored = 0;
+
+	ok = ok && previous;
+
+	for(; ok && restored < chunk_count; restored++) {
+		dcpu16_device_t *dev = computer->devices[chunks[restored].slot];
+		if(!dev || !dev->load_state)
+			continue;
+
+		if(dev->state_size && dev->save_state) {
+			previous[restored].size = dev->state_size(dev);
+			previous[restored].data = malloc(previous[restored].size ? previous[restored].size : 1);
+			if(!previous[restored].data) {
+				ok = 0;
+				break;
+			}
+
+			dev->save_state(dev, previous[restored].data);
+		}
+
+		if(!dev->load_state(dev, chunks[restored].data, chunks[restored].size)) {
+			ok = 0;
+			restored++;
+			break;
+		}
+	}
+
+	if(!ok) {
+		for(unsigned d = 0; previous && d < restored; d++) {
+			dcpu16_device_t *dev = computer->devices[chunks[d].slot];
+			if(previous[d].data)
+				dev->load_state(dev, previous[d].data, previous[d].size);
+		}
+	} else {
+		memcpy(computer->registers, state->registers, sizeof(computer->registers));
+		memcpy(computer->ram, state->ram, sizeof(computer->ram));
+		computer->stats.cycles = state->stats.cycles;
+	}
+
+	if(previous)
+		savestate_free_chunks(previous, chunk_count);
+	if(chunks)
+		savestate_free_chunks(chunks, chunk_count);
+
+	free(previous);
+	free(chunks);
+	free(chain);
+	free(state);
+
+	return ok;
+}
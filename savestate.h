@@ -0,0 +1,49 @@
+#ifndef SAVESTATE_H
+#define SAVESTATE_H
+
+#include "dcpu16.h"
+
+/* Save state file format (all integers little endian):
+
+	char[8]		magic "DCPUSAVE"
+	u16		version
+	u16		flags (SAVESTATE_FLAG_*)
+	u32		hash of the base state (delta files only)
+	u16 + bytes	path of the base state file, relative to the directory of the delta (delta files only)
+	u16[11]		registers
+	u64		cycles executed
+	u8[32]		one bit per RAM page that is stored in the file
+	for every stored page:
+		u16		compressed size
+		bytes		page compressed with savestate_compress_page
+	u16		number of device chunks
+	for every device chunk:
+		u16		slot
+		u32		size
+		bytes		device state
+
+   RAM is split into SAVESTATE_PAGE_WORDS pages. A full state stores the pages that aren't all zeros,
+   a delta state stores the pages that differ from the base, XORed with the base page. */
+
+#define SAVESTATE_VERSION			1
+#define SAVESTATE_FLAG_DELTA			0x0001
+
+#define SAVESTATE_PAGE_WORDS			256
+#define SAVESTATE_PAGE_COUNT			(DCPU16_RAM_SIZE / SAVESTATE_PAGE_WORDS)
+
+// Worst case size of a compressed page (every word is a literal)
+#define SAVESTATE_MAX_COMPRESSED_PAGE		(SAVESTATE_PAGE_WORDS * 2 + SAVESTATE_PAGE_WORDS / 128 + 1)
+
+#define SAVESTATE_IO_BUFFER_SIZE		0x10000
+
+// Deltas (including the full state at the end) a state can be built from
+#define SAVESTATE_MAX_CHAIN			16
+
+unsigned savestate_hash(const dcpu16_t *computer);
+unsigned savestate_compress_page(const DCPU16_WORD *page, unsigned char *out);
+int savestate_decompress_page(const unsigned char *in, unsigned size, DCPU16_WORD *page);
+int savestate_same_file(const char *a, const char *b);
+int savestate_save(const dcpu16_t *computer, const char *file, const dcpu16_t *base, const char *base_file);
+int savestate_load(dcpu16_t *computer, const char *file);
+
+#endif // SAVESTATE_H